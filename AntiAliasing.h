@@ -0,0 +1,214 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <atomic>
+#include <string>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+// The anti-aliasing modes of the main pass, switchable at runtime. The MSAA modes only change
+// the samples of DynamicResolution's target, which is resolved explicitly. The others render
+// it without MSAA and filter the resolved image at the render resolution, before the upscale:
+// - FXAA (fxaa.fsh) blends across luma edges in one pass, searching along them for their ends.
+// - SMAA (smaaEdges.fsh, smaaBlend.fsh) finds the edges first, then follows them to their ends
+//   and blends each pixel by how much of it the line between the ends covers.
+// - TAA (taa.fsh) jitters the projection by a subpixel offset every frame and blends the frame
+//   into a history reprojected with the camera's previous matrices, clamped to the new pixel's
+//   neighbourhood so moving objects do not leave trails.
+// Post passes sample from units 0, 2 and 3, whose 2D targets the scene leaves unused.
+class AntiAliasing
+{
+public:
+	enum Mode { OFF, MSAA_2X, MSAA_4X, MSAA_8X, FXAA, SMAA, TAA, MODE_COUNT };
+	static const int JITTER_FRAMES = 8;
+
+	static const char* Name(int mode)
+	{
+		static const char* names[MODE_COUNT] = { "off", "msaa2", "msaa4", "msaa8", "fxaa", "smaa", "taa" };
+		return names[mode];
+	}
+	// -1 if name is not one of the modes
+	static int Parse(const std::string& name)
+	{
+		for(int mode = 0; mode < MODE_COUNT; mode++)
+		{
+			if(name == Name(mode))
+				return mode;
+		}
+		return -1;
+	}
+	// of the main pass's target
+	static int Samples(int mode)
+	{
+		return mode == MSAA_2X ? 2 : mode == MSAA_4X ? 4 : mode == MSAA_8X ? 8 : 1;
+	}
+
+	// Main thread: the frame's subpixel offset for TAA, in pixels from the center.
+	// Halton (2, 3) points, which cover the pixel evenly over JITTER_FRAMES frames.
+	static glm::vec2 Jitter(unsigned int frame)
+	{
+		int index = int(frame % JITTER_FRAMES) + 1;
+		return glm::vec2(halton(index, 2) - 0.5f, halton(index, 3) - 0.5f);
+	}
+
+	// Main thread: whether the last frame went through taa.fsh. Until it does (its program may
+	// still be compiling) the projection is not jittered, nothing would take the jitter out again.
+	bool TaaApplied() const
+	{
+		return taaApplied.load(std::memory_order_relaxed);
+	}
+
+	// the post passes' programs, 0 while compiling (the pass is skipped)
+	struct Programs
+	{
+		GLuint fxaa, smaaEdges, smaaBlend, taa;
+	};
+
+	// GL thread
+	void Create()
+	{
+		glGenFramebuffers(1, &framebuffer);
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		releaseTextures();
+		glDeleteFramebuffers(1, &framebuffer);
+		framebuffer = 0;
+	}
+
+	// GL thread: filters the corner of color at the render size for mode and returns the texture
+	// holding the result, in the same corner. color and depth come without MSAA, width and height
+	// are their full size. The view projections are the camera's without the jitter.
+	GLuint Apply(int mode, const Programs& programs, GLuint color, GLuint depth, GLint renderWidth, GLint renderHeight, GLint width, GLint height,
+		const glm::mat4& viewProjection, const glm::mat4& previousViewProjection, GLuint emptyVAO)
+	{
+		// the history is only good for the frame right after it, at the same size
+		bool historyUsable = historyValid && lastMode == TAA && renderWidth == historyWidth && renderHeight == historyHeight;
+		lastMode = mode;
+		historyValid = false;
+
+		GLuint program = mode == FXAA ? programs.fxaa : mode == SMAA ? programs.smaaBlend : mode == TAA ? programs.taa : 0;
+		taaApplied.store(mode == TAA && program, std::memory_order_relaxed);
+		if(!program || (mode == SMAA && !programs.smaaEdges))
+			return color;
+		if(width != this->width || height != this->height)
+		{
+			allocateTextures(width, height);
+			historyUsable = false;
+		}
+
+		glDisable(GL_DEPTH_TEST);
+		glBindVertexArray(emptyVAO);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, renderWidth, renderHeight);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, color);
+
+		GLuint result = output;
+		if(mode == SMAA)
+		{
+			drawInto(edges, programs.smaaEdges, renderWidth, renderHeight);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, edges);
+		} else if(mode == TAA)
+		{
+			result = history[currentHistory];
+			glUseProgram(program);
+			glUniformMatrix4fv(glGetUniformLocation(program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(viewProjection)));
+			glUniformMatrix4fv(glGetUniformLocation(program, "previousViewProjection"), 1, GL_FALSE, glm::value_ptr(previousViewProjection));
+			glUniform1i(glGetUniformLocation(program, "historyValid"), historyUsable ? 1 : 0);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, history[1 - currentHistory]);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, depth);
+			currentHistory = 1 - currentHistory;
+			historyValid = true;
+			historyWidth = renderWidth;
+			historyHeight = renderHeight;
+		}
+		drawInto(result, program, renderWidth, renderHeight);
+
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glEnable(GL_DEPTH_TEST);
+		return result;
+	}
+
+private:
+	GLuint framebuffer = 0;
+	GLuint edges = 0;		// SMAA's, RG8
+	GLuint output = 0;		// FXAA's and SMAA's result
+	GLuint history[2] = {};	// TAA's results, the current frame's and the last one's
+	GLint width = 0, height = 0;
+
+	int lastMode = OFF;
+	int currentHistory = 0;
+	bool historyValid = false;
+	std::atomic<bool> taaApplied{ false };
+	GLint historyWidth = 0, historyHeight = 0;
+
+	static float halton(int index, int base)
+	{
+		float result = 0.0f;
+		float fraction = 1.0f;
+		while(index > 0)
+		{
+			fraction /= base;
+			result += fraction * (index % base);
+			index /= base;
+		}
+		return result;
+	}
+
+	void drawInto(GLuint texture, GLuint program, GLint renderWidth, GLint renderHeight)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		glUseProgram(program);
+		glUniform2i(glGetUniformLocation(program, "sourceSize"), renderWidth, renderHeight);
+		glUniform2f(glGetUniformLocation(program, "texelSize"), 1.0f / width, 1.0f / height);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	static GLuint createTexture(GLenum format, GLint width, GLint height)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format == GL_RG8 ? GL_RG : GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+
+	void allocateTextures(GLint width, GLint height)
+	{
+		releaseTextures();
+		this->width = width;
+		this->height = height;
+		edges = createTexture(GL_RG8, width, height);
+		output = createTexture(GL_RGBA8, width, height);
+		history[0] = createTexture(GL_RGBA8, width, height);
+		history[1] = createTexture(GL_RGBA8, width, height);
+		historyValid = false;
+	}
+
+	void releaseTextures()
+	{
+		glDeleteTextures(1, &edges);
+		glDeleteTextures(1, &output);
+		glDeleteTextures(2, history);
+		edges = output = history[0] = history[1] = 0;
+		width = height = 0;
+	}
+};
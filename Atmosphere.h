@@ -0,0 +1,185 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Earth-like atmosphere (Rayleigh, Mie and ozone, distances in km) and its precomputed
+// lookup tables: transmittance to the top of the atmosphere, and single scattering as
+// seen from the ground. The viewer always stands on the ground, so the scattering table
+// only depends on the view zenith (mu), sun zenith (muS) and view-sun angle (nu).
+// The phase functions are left out of the table and applied per pixel in sky.fsh.
+namespace atmosphere
+{
+	const float GROUND_RADIUS = 6360.0f;
+	const float TOP_RADIUS = 6420.0f;
+	const float VIEWER_HEIGHT = 0.01f;
+
+	const glm::vec3 RAYLEIGH_SCATTERING(5.802e-3f, 13.558e-3f, 33.1e-3f);
+	const float RAYLEIGH_HEIGHT = 8.0f;
+	const float MIE_SCATTERING = 3.996e-3f;
+	const float MIE_EXTINCTION = 4.44e-3f;
+	const float MIE_HEIGHT = 1.2f;
+	const float MIE_G = 0.8f;
+	const glm::vec3 OZONE_ABSORPTION(0.65e-3f, 1.881e-3f, 0.085e-3f);
+
+	const int TRANSMITTANCE_WIDTH = 256;		// mu
+	const int TRANSMITTANCE_HEIGHT = 64;		// altitude
+	const int SCATTERING_MU = 128;
+	const int SCATTERING_MU_S = 32;
+	const int SCATTERING_NU = 16;
+
+	// zenith cosines are stored with more resolution around the horizon, sky.fsh uses the same mapping
+	inline float MuToCoordinate(float mu)
+	{
+		return 0.5f + 0.5f * (mu < 0.0f ? -1.0f : 1.0f) * std::sqrt(std::abs(mu));
+	}
+	inline float CoordinateToMu(float coordinate)
+	{
+		float x = 2.0f * coordinate - 1.0f;
+		return x * std::abs(x);
+	}
+
+	inline float RadiusToCoordinate(float r)
+	{
+		return std::sqrt(glm::clamp((r - GROUND_RADIUS) / (TOP_RADIUS - GROUND_RADIUS), 0.0f, 1.0f));
+	}
+	inline float CoordinateToRadius(float coordinate)
+	{
+		return GROUND_RADIUS + (TOP_RADIUS - GROUND_RADIUS) * coordinate * coordinate;
+	}
+
+	// Scattering and extinction coefficients at an altitude
+	inline void Coefficients(float altitude, glm::vec3& rayleigh, float& mie, glm::vec3& extinction)
+	{
+		float rayleighDensity = std::exp(-altitude / RAYLEIGH_HEIGHT);
+		float mieDensity = std::exp(-altitude / MIE_HEIGHT);
+		float ozoneDensity = std::max(0.0f, 1.0f - std::abs(altitude - 25.0f) / 15.0f);
+		rayleigh = RAYLEIGH_SCATTERING * rayleighDensity;
+		mie = MIE_SCATTERING * mieDensity;
+		extinction = rayleigh + glm::vec3(MIE_EXTINCTION * mieDensity) + OZONE_ABSORPTION * ozoneDensity;
+	}
+
+	// Distance from radius r along zenith cosine mu to the top of the atmosphere
+	inline float DistanceToTop(float r, float mu)
+	{
+		float discriminant = r * r * (mu * mu - 1.0f) + TOP_RADIUS * TOP_RADIUS;
+		return std::max(0.0f, -r * mu + std::sqrt(std::max(discriminant, 0.0f)));
+	}
+
+	// Distance to the ground, or a negative value if the ray misses it
+	inline float DistanceToGround(float r, float mu)
+	{
+		float discriminant = r * r * (mu * mu - 1.0f) + GROUND_RADIUS * GROUND_RADIUS;
+		if(mu >= 0.0f || discriminant < 0.0f)
+			return -1.0f;
+		return -r * mu - std::sqrt(discriminant);
+	}
+
+	struct Tables
+	{
+		std::vector<float> transmittance;	// RGB, TRANSMITTANCE_WIDTH x TRANSMITTANCE_HEIGHT
+		std::vector<float> scattering;		// RGB Rayleigh + red Mie, SCATTERING_MU x SCATTERING_MU_S x SCATTERING_NU
+
+		// bilinear lookup of the transmittance from radius r towards zenith cosine mu
+		glm::vec3 Transmittance(float r, float mu) const
+		{
+			float x = MuToCoordinate(mu) * (TRANSMITTANCE_WIDTH - 1);
+			float y = RadiusToCoordinate(r) * (TRANSMITTANCE_HEIGHT - 1);
+			int x0 = std::min(int(x), TRANSMITTANCE_WIDTH - 2);
+			int y0 = std::min(int(y), TRANSMITTANCE_HEIGHT - 2);
+			float fx = x - x0, fy = y - y0;
+
+			auto texel = [this](int x, int y)
+			{
+				const float* t = &transmittance[(size_t(y) * TRANSMITTANCE_WIDTH + x) * 3];
+				return glm::vec3(t[0], t[1], t[2]);
+			};
+			glm::vec3 bottom = glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+			glm::vec3 top = glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+			return glm::mix(bottom, top, fy);
+		}
+	};
+
+	// One altitude row of the transmittance table
+	inline void ComputeTransmittanceRow(Tables& tables, int row)
+	{
+		const int STEPS = 64;
+		float r = CoordinateToRadius(float(row) / (TRANSMITTANCE_HEIGHT - 1));
+		for(int column = 0; column < TRANSMITTANCE_WIDTH; column++)
+		{
+			float mu = CoordinateToMu(float(column) / (TRANSMITTANCE_WIDTH - 1));
+			float stepLength = DistanceToTop(r, mu) / STEPS;
+
+			glm::vec3 opticalDepth(0.0f);
+			for(int i = 0; i < STEPS; i++)
+			{
+				float t = (i + 0.5f) * stepLength;
+				float altitude = std::sqrt(t * t + 2.0f * r * mu * t + r * r) - GROUND_RADIUS;
+				glm::vec3 rayleigh, extinction;
+				float mie;
+				Coefficients(altitude, rayleigh, mie, extinction);
+				opticalDepth += extinction * stepLength;
+			}
+
+			glm::vec3 transmittance = glm::exp(-opticalDepth);
+			float* texel = &tables.transmittance[(size_t(row) * TRANSMITTANCE_WIDTH + column) * 3];
+			texel[0] = transmittance.x;
+			texel[1] = transmittance.y;
+			texel[2] = transmittance.z;
+		}
+	}
+
+	// One (muS, nu) line of the scattering table, needs the whole transmittance table
+	inline void ComputeScatteringLine(Tables& tables, int muSIndex, int nuIndex)
+	{
+		const int STEPS = 32;
+		float r0 = GROUND_RADIUS + VIEWER_HEIGHT;
+		float muS = CoordinateToMu(float(muSIndex) / (SCATTERING_MU_S - 1));
+		float nu = 2.0f * nuIndex / (SCATTERING_NU - 1) - 1.0f;
+
+		for(int muIndex = 0; muIndex < SCATTERING_MU; muIndex++)
+		{
+			float mu = CoordinateToMu(float(muIndex) / (SCATTERING_MU - 1));
+
+			// view in the xz plane, sun placed to match muS and nu as closely as possible
+			glm::vec3 view(std::sqrt(std::max(0.0f, 1.0f - mu * mu)), 0.0f, mu);
+			float sunX = view.x > 1e-4f ? (nu - mu * muS) / view.x : 0.0f;
+			sunX = glm::clamp(sunX, -std::sqrt(std::max(0.0f, 1.0f - muS * muS)), std::sqrt(std::max(0.0f, 1.0f - muS * muS)));
+			glm::vec3 sun(sunX, std::sqrt(std::max(0.0f, 1.0f - muS * muS - sunX * sunX)), muS);
+
+			float rayLength = DistanceToGround(r0, mu);
+			if(rayLength < 0.0f)
+				rayLength = DistanceToTop(r0, mu);
+			float stepLength = rayLength / STEPS;
+
+			glm::vec3 rayleighSum(0.0f), mieSum(0.0f), opticalDepth(0.0f);
+			for(int i = 0; i < STEPS; i++)
+			{
+				glm::vec3 point = glm::vec3(0.0f, 0.0f, r0) + view * ((i + 0.5f) * stepLength);
+				float r = glm::length(point);
+				glm::vec3 rayleigh, extinction;
+				float mie;
+				Coefficients(r - GROUND_RADIUS, rayleigh, mie, extinction);
+
+				// transmittance from the viewer to the middle of this step
+				glm::vec3 viewTransmittance = glm::exp(-(opticalDepth + extinction * (0.5f * stepLength)));
+				opticalDepth += extinction * stepLength;
+
+				float pointMuS = glm::dot(point, sun) / r;
+				if(DistanceToGround(r, pointMuS) >= 0.0f)
+					continue;	// the sun is behind the planet
+				glm::vec3 light = viewTransmittance * tables.Transmittance(r, pointMuS) * stepLength;
+				rayleighSum += light * rayleigh;
+				mieSum += light * mie;
+			}
+
+			float* texel = &tables.scattering[((size_t(nuIndex) * SCATTERING_MU_S + muSIndex) * SCATTERING_MU + muIndex) * 4];
+			texel[0] = rayleighSum.x;
+			texel[1] = rayleighSum.y;
+			texel[2] = rayleighSum.z;
+			texel[3] = mieSum.x;
+		}
+	}
+}
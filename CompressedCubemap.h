@@ -0,0 +1,306 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// BC1 (DXT1) compressed cubemap with a full mip chain, stored as a DDS file.
+// The skybox is cooked into this format offline (--cook-skybox) so that startup
+// only has to read the file and hand the blocks to glCompressedTexImage2D.
+struct CompressedCubemap
+{
+	static const int BLOCK_SIZE = 8;	// bytes per 4x4 block
+
+	int width = 0, height = 0;
+	int levels = 0;
+	std::vector<unsigned char> data;	// face by face (+X, -X, +Y, -Y, +Z, -Z), each face largest mip first
+
+	static int LevelWidth(int width, int level) { return std::max(1, width >> level); }
+	static size_t LevelSize(int width, int height, int level)
+	{
+		size_t blocksX = (LevelWidth(width, level) + 3) / 4;
+		size_t blocksY = (LevelWidth(height, level) + 3) / 4;
+		return blocksX * blocksY * BLOCK_SIZE;
+	}
+
+	size_t FaceSize() const
+	{
+		size_t size = 0;
+		for(int level = 0; level < levels; level++)
+			size += LevelSize(width, height, level);
+		return size;
+	}
+
+	// offset of a face's mip level inside data
+	size_t Offset(int face, int level) const
+	{
+		size_t offset = face * FaceSize();
+		for(int i = 0; i < level; i++)
+			offset += LevelSize(width, height, i);
+		return offset;
+	}
+};
+
+namespace bc1
+{
+	inline uint16_t PackColor(const float color[3])
+	{
+		int r = std::min(31, std::max(0, int(color[0] * 31.0f / 255.0f + 0.5f)));
+		int g = std::min(63, std::max(0, int(color[1] * 63.0f / 255.0f + 0.5f)));
+		int b = std::min(31, std::max(0, int(color[2] * 31.0f / 255.0f + 0.5f)));
+		return uint16_t((r << 11) | (g << 5) | b);
+	}
+
+	inline void UnpackColor(uint16_t packed, int color[3])
+	{
+		color[0] = ((packed >> 11) & 31) * 255 / 31;
+		color[1] = ((packed >> 5) & 63) * 255 / 63;
+		color[2] = (packed & 31) * 255 / 31;
+	}
+
+	// The four colors a block can use. With color0 <= color1 BC1 switches to 3 colors + black.
+	inline void Palette(uint16_t color0, uint16_t color1, int palette[4][3])
+	{
+		UnpackColor(color0, palette[0]);
+		UnpackColor(color1, palette[1]);
+		for(int c = 0; c < 3; c++)
+		{
+			if(color0 > color1)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			} else
+			{
+				palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+				palette[3][c] = 0;
+			}
+		}
+	}
+
+	// Compresses 16 RGB pixels. The endpoints are the extremes of the pixels
+	// along their principal axis, found with a few power iterations on the covariance.
+	inline void EncodeBlock(const unsigned char pixels[16][3], unsigned char block[8])
+	{
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+		for(int i = 0; i < 16; i++)
+			for(int c = 0; c < 3; c++)
+				mean[c] += pixels[i][c] / 16.0f;
+
+		float covariance[3][3] = {};
+		for(int i = 0; i < 16; i++)
+			for(int a = 0; a < 3; a++)
+				for(int b = 0; b < 3; b++)
+					covariance[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+
+		float axis[3] = { 1.0f, 1.0f, 1.0f };
+		for(int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[3];
+			for(int a = 0; a < 3; a++)
+				next[a] = covariance[a][0] * axis[0] + covariance[a][1] * axis[1] + covariance[a][2] * axis[2];
+			float length = std::max(std::max(std::abs(next[0]), std::abs(next[1])), std::abs(next[2]));
+			if(length < 1e-6f)
+				break;
+			for(int a = 0; a < 3; a++)
+				axis[a] = next[a] / length;
+		}
+
+		float minProjection = 1e30f, maxProjection = -1e30f;
+		for(int i = 0; i < 16; i++)
+		{
+			float projection = 0.0f;
+			for(int c = 0; c < 3; c++)
+				projection += (pixels[i][c] - mean[c]) * axis[c];
+			minProjection = std::min(minProjection, projection);
+			maxProjection = std::max(maxProjection, projection);
+		}
+
+		float axisLengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+		float endpoint0[3], endpoint1[3];
+		for(int c = 0; c < 3; c++)
+		{
+			endpoint0[c] = mean[c] + axis[c] * maxProjection / axisLengthSquared;
+			endpoint1[c] = mean[c] + axis[c] * minProjection / axisLengthSquared;
+		}
+
+		uint16_t color0 = PackColor(endpoint0);
+		uint16_t color1 = PackColor(endpoint1);
+		if(color0 < color1)
+			std::swap(color0, color1);
+
+		uint32_t indices = 0;
+		if(color0 != color1)
+		{
+			int palette[4][3];
+			Palette(color0, color1, palette);
+			for(int i = 0; i < 16; i++)
+			{
+				int best = 0, bestDistance = 1 << 30;
+				for(int p = 0; p < 4; p++)
+				{
+					int distance = 0;
+					for(int c = 0; c < 3; c++)
+						distance += (pixels[i][c] - palette[p][c]) * (pixels[i][c] - palette[p][c]);
+					if(distance < bestDistance)
+					{
+						best = p;
+						bestDistance = distance;
+					}
+				}
+				indices |= uint32_t(best) << (i * 2);
+			}
+		}
+
+		block[0] = color0 & 0xFF;
+		block[1] = color0 >> 8;
+		block[2] = color1 & 0xFF;
+		block[3] = color1 >> 8;
+		for(int i = 0; i < 4; i++)
+			block[4 + i] = (indices >> (i * 8)) & 0xFF;
+	}
+
+	// Compresses a whole RGB8 image, edge pixels are repeated to fill partial blocks
+	inline void Encode(const unsigned char* rgb, int width, int height, unsigned char* out)
+	{
+		for(int blockY = 0; blockY < (height + 3) / 4; blockY++)
+		{
+			for(int blockX = 0; blockX < (width + 3) / 4; blockX++)
+			{
+				unsigned char pixels[16][3];
+				for(int i = 0; i < 16; i++)
+				{
+					int x = std::min(blockX * 4 + i % 4, width - 1);
+					int y = std::min(blockY * 4 + i / 4, height - 1);
+					memcpy(pixels[i], rgb + (size_t(y) * width + x) * 3, 3);
+				}
+				EncodeBlock(pixels, out);
+				out += CompressedCubemap::BLOCK_SIZE;
+			}
+		}
+	}
+
+	// CPU fallback for drivers without S3TC support
+	inline void Decode(const unsigned char* blocks, int width, int height, unsigned char* rgb)
+	{
+		for(int blockY = 0; blockY < (height + 3) / 4; blockY++)
+		{
+			for(int blockX = 0; blockX < (width + 3) / 4; blockX++)
+			{
+				uint16_t color0 = uint16_t(blocks[0] | (blocks[1] << 8));
+				uint16_t color1 = uint16_t(blocks[2] | (blocks[3] << 8));
+				uint32_t indices = blocks[4] | (blocks[5] << 8) | (blocks[6] << 16) | (uint32_t(blocks[7]) << 24);
+				int palette[4][3];
+				Palette(color0, color1, palette);
+
+				for(int i = 0; i < 16; i++)
+				{
+					int x = blockX * 4 + i % 4;
+					int y = blockY * 4 + i / 4;
+					if(x >= width || y >= height)
+						continue;
+					const int* color = palette[(indices >> (i * 2)) & 3];
+					unsigned char* pixel = rgb + (size_t(y) * width + x) * 3;
+					for(int c = 0; c < 3; c++)
+						pixel[c] = static_cast<unsigned char>(color[c]);
+				}
+				blocks += CompressedCubemap::BLOCK_SIZE;
+			}
+		}
+	}
+}
+
+// Halves an RGB8 image with a 2x2 box filter
+inline std::vector<unsigned char> DownsampleRGB(const std::vector<unsigned char>& rgb, int width, int height)
+{
+	int newWidth = std::max(1, width / 2);
+	int newHeight = std::max(1, height / 2);
+	std::vector<unsigned char> result(size_t(newWidth) * newHeight * 3);
+	for(int y = 0; y < newHeight; y++)
+	{
+		for(int x = 0; x < newWidth; x++)
+		{
+			int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+			int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for(int c = 0; c < 3; c++)
+			{
+				int sum = rgb[(size_t(y0) * width + x0) * 3 + c] + rgb[(size_t(y0) * width + x1) * 3 + c]
+					+ rgb[(size_t(y1) * width + x0) * 3 + c] + rgb[(size_t(y1) * width + x1) * 3 + c];
+				result[(size_t(y) * newWidth + x) * 3 + c] = static_cast<unsigned char>((sum + 2) / 4);
+			}
+		}
+	}
+	return result;
+}
+
+namespace dds
+{
+	const uint32_t MAGIC = 0x20534444;			// "DDS "
+	const uint32_t FOURCC_DXT1 = 0x31545844;	// "DXT1"
+
+	const uint32_t FLAGS = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;	// caps, height, width, pixel format, mip count, linear size
+	const uint32_t PIXEL_FORMAT_FOURCC = 0x4;
+	const uint32_t CAPS = 0x8 | 0x1000 | 0x400000;		// complex, texture, mipmap
+	const uint32_t CAPS2_CUBEMAP = 0x200 | 0xFC00;		// cubemap with all six faces
+
+	struct Header
+	{
+		uint32_t size, flags, height, width, pitchOrLinearSize, depth, mipMapCount;
+		uint32_t reserved1[11];
+		struct
+		{
+			uint32_t size, flags, fourCC, rgbBitCount, rBitMask, gBitMask, bBitMask, aBitMask;
+		} pixelFormat;
+		uint32_t caps, caps2, caps3, caps4, reserved2;
+	};
+	static_assert(sizeof(Header) == 124, "DDS header has to be 124 bytes");
+}
+
+inline bool SaveCompressedCubemap(const std::string& path, const CompressedCubemap& cubemap)
+{
+	dds::Header header = {};
+	header.size = sizeof(dds::Header);
+	header.flags = dds::FLAGS;
+	header.width = cubemap.width;
+	header.height = cubemap.height;
+	header.pitchOrLinearSize = static_cast<uint32_t>(CompressedCubemap::LevelSize(cubemap.width, cubemap.height, 0));
+	header.mipMapCount = cubemap.levels;
+	header.pixelFormat.size = 32;
+	header.pixelFormat.flags = dds::PIXEL_FORMAT_FOURCC;
+	header.pixelFormat.fourCC = dds::FOURCC_DXT1;
+	header.caps = dds::CAPS;
+	header.caps2 = dds::CAPS2_CUBEMAP;
+
+	std::ofstream file(path, std::ios::binary);
+	if(file.fail())
+		return false;
+	file.write(reinterpret_cast<const char*>(&dds::MAGIC), sizeof(dds::MAGIC));
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(cubemap.data.data()), cubemap.data.size());
+	return file.good();
+}
+
+// Reads a DXT1 cubemap written by SaveCompressedCubemap. Returns false for anything else.
+inline bool LoadCompressedCubemap(const std::string& path, CompressedCubemap& cubemap)
+{
+	std::ifstream file(path, std::ios::binary);
+	if(file.fail())
+		return false;
+
+	uint32_t magic = 0;
+	dds::Header header = {};
+	file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || magic != dds::MAGIC || header.size != sizeof(dds::Header)
+		|| header.pixelFormat.fourCC != dds::FOURCC_DXT1 || (header.caps2 & dds::CAPS2_CUBEMAP) != dds::CAPS2_CUBEMAP)
+		return false;
+
+	cubemap.width = header.width;
+	cubemap.height = header.height;
+	cubemap.levels = std::max<uint32_t>(1, header.mipMapCount);
+	cubemap.data.resize(cubemap.FaceSize() * 6);
+	file.read(reinterpret_cast<char*>(cubemap.data.data()), cubemap.data.size());
+	return bool(file);
+}
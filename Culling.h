@@ -0,0 +1,87 @@
+#pragma once
+#include <cfloat>
+
+#include <glm/glm.hpp>
+
+// Axis aligned bounding box
+struct AABB
+{
+	glm::vec3 min = glm::vec3(FLT_MAX);
+	glm::vec3 max = glm::vec3(-FLT_MAX);
+
+	void Extend(const glm::vec3& point)
+	{
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	bool Valid() const { return min.x <= max.x; }
+
+	// Bounds of this box after transform, using the center/extents form
+	AABB Transformed(const glm::mat4& transform) const
+	{
+		glm::vec3 center = (min + max) * 0.5f;
+		glm::vec3 extents = (max - min) * 0.5f;
+
+		glm::vec3 newCenter = glm::vec3(transform * glm::vec4(center, 1.0f));
+		glm::vec3 newExtents(0.0f);
+		for(int i = 0; i < 3; i++)
+		{
+			for(int j = 0; j < 3; j++)
+			{
+				newExtents[i] += glm::abs(transform[j][i]) * extents[j];
+			}
+		}
+
+		AABB result;
+		result.min = newCenter - newExtents;
+		result.max = newCenter + newExtents;
+		return result;
+	}
+};
+
+// Six planes extracted from a view-projection matrix, normals pointing inwards
+struct Frustum
+{
+	glm::vec4 planes[6];
+
+	explicit Frustum(const glm::mat4& viewProjection)
+	{
+		for(int i = 0; i < 3; i++)
+		{
+			for(int j = 0; j < 4; j++)
+			{
+				planes[i * 2][j] = viewProjection[j][3] + viewProjection[j][i];
+				planes[i * 2 + 1][j] = viewProjection[j][3] - viewProjection[j][i];
+			}
+		}
+	}
+
+	// false only if the box is completely outside one of the planes
+	bool Intersects(const AABB& box) const
+	{
+		for(const glm::vec4& plane : planes)
+		{
+			// corner of the box furthest along the plane normal
+			glm::vec3 positive(
+				plane.x >= 0.0f ? box.max.x : box.min.x,
+				plane.y >= 0.0f ? box.max.y : box.min.y,
+				plane.z >= 0.0f ? box.max.z : box.min.z);
+			if(glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+				return false;
+		}
+		return true;
+	}
+
+	// false only if the sphere is completely outside one of the planes
+	bool Intersects(const glm::vec3& center, float radius) const
+	{
+		for(const glm::vec4& plane : planes)
+		{
+			// the planes are not normalized
+			if(glm::dot(glm::vec3(plane), center) + plane.w < -radius * glm::length(glm::vec3(plane)))
+				return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,250 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+
+// Offscreen target of the main pass, rendered at a fraction of the window's resolution and
+// upscaled to it at the end of the frame. The render thread times every frame on the GPU with
+// a pair of timestamp queries (probe updates already use GL_TIME_ELAPSED, which cannot nest)
+// and steers the scale towards TARGET_MILLISECONDS: down when a frame goes over, back up when
+// the next step is predicted to fit, assuming the cost follows the pixel count. The main thread
+// reads the scale when recording a frame, so culling, LODs and texture streaming see the real size.
+// The target is allocated at the window's size and only the corner at the render size is used,
+// so changing the scale never reallocates it. Its MSAA samples can change from frame to frame;
+// without MSAA its depth is a texture, for TAA's reprojection.
+class DynamicResolution
+{
+public:
+	static constexpr float TARGET_MILLISECONDS = 14.0f;	// some headroom under 60 Hz
+	static constexpr float MIN_SCALE = 0.5f;
+	static constexpr float SCALE_STEP = 0.05f;
+	static constexpr float HEADROOM = 0.9f;		// scales back up only below this much of the target
+	static const int QUERY_FRAMES = 4;			// timings read this many frames late at worst
+
+	// GL thread. Not adaptive keeps the window's size.
+	void Create(bool adaptive)
+	{
+		glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+		this->adaptive = adaptive;
+		glGenFramebuffers(1, &framebuffer);
+		glGenFramebuffers(1, &resolveFramebuffer);
+		glGenFramebuffers(1, &presentFramebuffer);
+		glGenQueries(QUERY_FRAMES * 2, &queries[0][0]);
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		releaseTarget();
+		glDeleteQueries(QUERY_FRAMES * 2, &queries[0][0]);
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteFramebuffers(1, &resolveFramebuffer);
+		glDeleteFramebuffers(1, &presentFramebuffer);
+		framebuffer = resolveFramebuffer = presentFramebuffer = 0;
+	}
+
+	// Main thread: the size to render the main pass at for a window this big
+	void RenderSize(GLint width, GLint height, GLint& renderWidth, GLint& renderHeight) const
+	{
+		float current = scale.load(std::memory_order_relaxed);
+		renderWidth = std::max(GLint(std::lround(width * current)), 1);
+		renderHeight = std::max(GLint(std::lround(height * current)), 1);
+	}
+
+	// GL thread: starts timing the frame and makes sure the target fits the window, with this many MSAA samples
+	void BeginFrame(GLint viewportWidth, GLint viewportHeight, int samples)
+	{
+		collectTiming();
+		if(!pending[nextQuery])
+			glQueryCounter(queries[nextQuery][0], GL_TIMESTAMP);
+		samples = std::max(std::min(samples, int(maxSamples)), 1);
+		if(viewportWidth != width || viewportHeight != height || samples != this->samples)
+			allocateTarget(viewportWidth, viewportHeight, samples);
+	}
+
+	// GL thread: binds the target for the main pass, viewport at the render size
+	void BindTarget(GLint renderWidth, GLint renderHeight)
+	{
+		this->renderWidth = std::min(renderWidth, width);
+		this->renderHeight = std::min(renderHeight, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, this->renderWidth, this->renderHeight);
+	}
+
+	// GL thread: resolves the MSAA samples of the target into ColorTexture()
+	void Resolve()
+	{
+		if(samples == 1)
+			return;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFramebuffer);
+		glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, renderWidth, renderHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// GL thread, after Resolve(): the target's color, and its depth (0 with MSAA)
+	GLuint ColorTexture() const { return colorTexture; }
+	GLuint DepthTexture() const { return depthTexture; }
+	GLint RenderWidth() const { return renderWidth; }
+	GLint RenderHeight() const { return renderHeight; }
+	GLint Width() const { return width; }
+	GLint Height() const { return height; }
+
+	// GL thread: upscales the corner of texture (as big as the target) at the render size into
+	// the window with upscaleShader, a plain linear stretch while it is 0, and ends the frame's timing
+	void Present(GLuint texture, GLuint upscaleShader, GLuint emptyVAO)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+		bool native = renderWidth == width && renderHeight == height;
+		if(native || !upscaleShader)
+		{
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, presentFramebuffer);
+			glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+			glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT, native ? GL_NEAREST : GL_LINEAR);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		} else
+		{
+			glDisable(GL_DEPTH_TEST);
+			glUseProgram(upscaleShader);
+			glUniform2i(glGetUniformLocation(upscaleShader, "sourceSize"), renderWidth, renderHeight);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glBindVertexArray(emptyVAO);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glEnable(GL_DEPTH_TEST);
+		}
+
+		if(!pending[nextQuery])
+		{
+			glQueryCounter(queries[nextQuery][1], GL_TIMESTAMP);
+			pending[nextQuery] = true;
+			nextQuery = (nextQuery + 1) % QUERY_FRAMES;
+		}
+	}
+
+private:
+	int samples = 1;
+	GLint maxSamples = 1;
+	bool adaptive = true;
+	GLuint framebuffer = 0, resolveFramebuffer = 0;
+	GLuint presentFramebuffer = 0;	// reads whatever texture is presented
+	GLuint colorTexture = 0;		// resolved color
+	GLuint colorBuffer = 0;			// multisampled color and depth, 0 without MSAA
+	GLuint depthBuffer = 0;
+	GLuint depthTexture = 0;		// without MSAA
+	GLint width = 0, height = 0;	// of the window and the target
+	GLint renderWidth = 0, renderHeight = 0;
+
+	// render thread timing and control, the scale is read by the main thread
+	GLuint queries[QUERY_FRAMES][2] = {};	// frame start and end timestamps
+	bool pending[QUERY_FRAMES] = {};
+	int nextQuery = 0, oldestQuery = 0;
+	float frameMilliseconds = 0.0f;
+	std::atomic<float> scale{ 1.0f };
+
+	void allocateTarget(GLint width, GLint height, int samples)
+	{
+		releaseTarget();
+		this->width = width;
+		this->height = height;
+		this->samples = samples;
+
+		glGenTextures(1, &colorTexture);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		if(samples > 1)
+		{
+			glGenRenderbuffers(1, &colorBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+			glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+			glGenRenderbuffers(1, &depthBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+			glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		} else
+		{
+			glGenTextures(1, &depthTexture);
+			glBindTexture(GL_TEXTURE_2D, depthTexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		}
+		if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cerr << "Main pass framebuffer incomplete...\n";
+
+		glBindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, samples > 1 ? colorTexture : 0, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void releaseTarget()
+	{
+		glDeleteTextures(1, &colorTexture);
+		glDeleteTextures(1, &depthTexture);
+		glDeleteRenderbuffers(1, &colorBuffer);
+		glDeleteRenderbuffers(1, &depthBuffer);
+		colorTexture = depthTexture = colorBuffer = depthBuffer = 0;
+		width = height = 0;
+	}
+
+	// reads the finished frames' timings without stalling, oldest first
+	void collectTiming()
+	{
+		while(pending[oldestQuery])
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(queries[oldestQuery][1], GL_QUERY_RESULT_AVAILABLE, &available);
+			if(!available)
+				return;
+
+			GLuint64 start = 0, end = 0;
+			glGetQueryObjectui64v(queries[oldestQuery][0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(queries[oldestQuery][1], GL_QUERY_RESULT, &end);
+			pending[oldestQuery] = false;
+			oldestQuery = (oldestQuery + 1) % QUERY_FRAMES;
+
+			float milliseconds = (end - start) / 1000000.0f;
+			frameMilliseconds = frameMilliseconds == 0.0f ? milliseconds : frameMilliseconds * 0.8f + milliseconds * 0.2f;
+			if(adaptive)
+				updateScale();
+		}
+	}
+
+	// one step at a time, so a single slow frame does not halve the resolution
+	void updateScale()
+	{
+		float current = scale.load(std::memory_order_relaxed);
+		float next = current;
+		if(frameMilliseconds > TARGET_MILLISECONDS)
+			next = std::max(current - SCALE_STEP, MIN_SCALE);
+		else
+		{
+			float up = std::min(current + SCALE_STEP, 1.0f);
+			if(frameMilliseconds * (up * up) / (current * current) < TARGET_MILLISECONDS * HEADROOM)
+				next = up;
+		}
+		next = std::round(next / SCALE_STEP) * SCALE_STEP;
+		if(next == current)
+			return;
+		scale.store(next, std::memory_order_relaxed);
+		// the average was measured at the old size
+		frameMilliseconds *= (next * next) / (current * current);
+	}
+};
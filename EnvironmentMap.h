@@ -0,0 +1,216 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// CPU-side cubemap with a mip chain: faces[face][level] is an RGB8 image of
+// LevelSize(level) squared texels. Faces are in GL_TEXTURE_CUBE_MAP_POSITIVE_X order.
+struct CubeMipChain
+{
+	int size = 0;
+	int levels = 0;
+	std::vector<std::vector<unsigned char>> faces[6];
+
+	int LevelSize(int level) const { return std::max(1, size >> level); }
+};
+
+// Order 2 (9 coefficient) spherical harmonics of RGB radiance, in the usual
+// L00, L1-1, L10, L11, L2-2, L2-1, L20, L21, L22 order
+struct SphericalHarmonics
+{
+	glm::vec3 coefficients[9] = {};
+
+	SphericalHarmonics& operator+=(const SphericalHarmonics& other)
+	{
+		for(int i = 0; i < 9; i++)
+			coefficients[i] += other.coefficients[i];
+		return *this;
+	}
+
+	SphericalHarmonics operator*(const glm::vec3& tint) const
+	{
+		SphericalHarmonics result;
+		for(int i = 0; i < 9; i++)
+			result.coefficients[i] = coefficients[i] * tint;
+		return result;
+	}
+};
+
+namespace environment
+{
+	const float PI = 3.14159265358979f;
+
+	// Direction through the center of texel (x, y) of a face, following the GL cubemap layout
+	inline glm::vec3 TexelDirection(int face, int x, int y, int size)
+	{
+		float u = 2.0f * (x + 0.5f) / size - 1.0f;
+		float v = 2.0f * (y + 0.5f) / size - 1.0f;
+		switch(face)
+		{
+		case 0: return glm::normalize(glm::vec3(1.0f, -v, -u));
+		case 1: return glm::normalize(glm::vec3(-1.0f, -v, u));
+		case 2: return glm::normalize(glm::vec3(u, 1.0f, v));
+		case 3: return glm::normalize(glm::vec3(u, -1.0f, -v));
+		case 4: return glm::normalize(glm::vec3(u, -v, 1.0f));
+		default: return glm::normalize(glm::vec3(-u, -v, -1.0f));
+		}
+	}
+
+	// Inverse of TexelDirection: face and [0, 1] texture coordinates a direction lands on
+	inline int DirectionToFace(const glm::vec3& direction, float& s, float& t)
+	{
+		glm::vec3 a = glm::abs(direction);
+		int face;
+		float sc, tc, ma;
+		if(a.x >= a.y && a.x >= a.z)
+		{
+			face = direction.x > 0.0f ? 0 : 1;
+			sc = direction.x > 0.0f ? -direction.z : direction.z;
+			tc = -direction.y;
+			ma = a.x;
+		} else if(a.y >= a.z)
+		{
+			face = direction.y > 0.0f ? 2 : 3;
+			sc = direction.x;
+			tc = direction.y > 0.0f ? direction.z : -direction.z;
+			ma = a.y;
+		} else
+		{
+			face = direction.z > 0.0f ? 4 : 5;
+			sc = direction.z > 0.0f ? direction.x : -direction.x;
+			tc = -direction.y;
+			ma = a.z;
+		}
+		s = 0.5f * (sc / ma + 1.0f);
+		t = 0.5f * (tc / ma + 1.0f);
+		return face;
+	}
+
+	// Nearest texel of a mip level, as linear [0, 1] color
+	inline glm::vec3 Sample(const CubeMipChain& cubemap, const glm::vec3& direction, int level)
+	{
+		level = std::min(std::max(level, 0), cubemap.levels - 1);
+		float s, t;
+		int face = DirectionToFace(direction, s, t);
+		int size = cubemap.LevelSize(level);
+		int x = std::min(int(s * size), size - 1);
+		int y = std::min(int(t * size), size - 1);
+		const unsigned char* texel = &cubemap.faces[face][level][(size_t(y) * size + x) * 3];
+		return glm::vec3(texel[0], texel[1], texel[2]) / 255.0f;
+	}
+
+	inline glm::vec2 Hammersley(uint32_t i, uint32_t count)
+	{
+		uint32_t bits = i;
+		bits = (bits << 16u) | (bits >> 16u);
+		bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+		bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+		bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+		bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+		return glm::vec2(float(i) / float(count), float(bits) * 2.3283064365386963e-10f);
+	}
+
+	// GGX prefiltered radiance around normal (view = normal = reflection, as in split-sum IBL).
+	// Samples come from a source mip matching their solid angle, which keeps the sample count low.
+	inline glm::vec3 PrefilterGGX(const CubeMipChain& source, const glm::vec3& normal, float roughness, uint32_t sampleCount)
+	{
+		if(roughness <= 0.0f)
+			return Sample(source, normal, 0);
+
+		glm::vec3 up = std::abs(normal.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+		glm::vec3 tangent = glm::normalize(glm::cross(up, normal));
+		glm::vec3 bitangent = glm::cross(normal, tangent);
+
+		float alpha = roughness * roughness;
+		float texelSolidAngle = 4.0f * PI / (6.0f * source.size * source.size);
+
+		glm::vec3 sum(0.0f);
+		float weight = 0.0f;
+		for(uint32_t i = 0; i < sampleCount; i++)
+		{
+			glm::vec2 xi = Hammersley(i, sampleCount);
+			float phi = 2.0f * PI * xi.x;
+			float cosTheta = std::sqrt((1.0f - xi.y) / (1.0f + (alpha * alpha - 1.0f) * xi.y));
+			float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+			glm::vec3 halfway = tangent * (sinTheta * std::cos(phi)) + bitangent * (sinTheta * std::sin(phi)) + normal * cosTheta;
+			glm::vec3 light = 2.0f * glm::dot(normal, halfway) * halfway - normal;
+
+			float normalDotLight = glm::dot(normal, light);
+			if(normalDotLight <= 0.0f)
+				continue;
+
+			// pdf of the sample is D * NdotH / (4 * VdotH) = D / 4 with N = V
+			float denominator = cosTheta * cosTheta * (alpha * alpha - 1.0f) + 1.0f;
+			float distribution = alpha * alpha / (PI * denominator * denominator);
+			float sampleSolidAngle = 1.0f / (sampleCount * distribution * 0.25f + 1e-4f);
+			int level = int(0.5f * std::log2(sampleSolidAngle / texelSolidAngle) + 1.0f);
+
+			sum += Sample(source, light, level) * normalDotLight;
+			weight += normalDotLight;
+		}
+		return weight > 0.0f ? sum / weight : Sample(source, normal, 0);
+	}
+
+	// Projects one face of a cubemap onto the SH basis, each texel weighted by its solid angle.
+	// Summing all six faces gives the radiance of the whole environment.
+	inline SphericalHarmonics ProjectFace(const unsigned char* rgb, int size, int face)
+	{
+		SphericalHarmonics result;
+		for(int y = 0; y < size; y++)
+		{
+			for(int x = 0; x < size; x++, rgb += 3)
+			{
+				float u = 2.0f * (x + 0.5f) / size - 1.0f;
+				float v = 2.0f * (y + 0.5f) / size - 1.0f;
+				float solidAngle = 4.0f / (size * size * std::pow(1.0f + u * u + v * v, 1.5f));
+
+				glm::vec3 d = TexelDirection(face, x, y, size);
+				glm::vec3 radiance = glm::vec3(rgb[0], rgb[1], rgb[2]) * (solidAngle / 255.0f);
+				result.coefficients[0] += radiance * 0.282095f;
+				result.coefficients[1] += radiance * (0.488603f * d.y);
+				result.coefficients[2] += radiance * (0.488603f * d.z);
+				result.coefficients[3] += radiance * (0.488603f * d.x);
+				result.coefficients[4] += radiance * (1.092548f * d.x * d.y);
+				result.coefficients[5] += radiance * (1.092548f * d.y * d.z);
+				result.coefficients[6] += radiance * (0.315392f * (3.0f * d.z * d.z - 1.0f));
+				result.coefficients[7] += radiance * (1.092548f * d.x * d.z);
+				result.coefficients[8] += radiance * (0.546274f * (d.x * d.x - d.y * d.y));
+			}
+		}
+		return result;
+	}
+
+	// Environment whose diffuse irradiance is the same in every direction, i.e. a
+	// plain ambient term of value (as evaluated by main.fsh, which divides by PI)
+	inline SphericalHarmonics ConstantAmbient(const glm::vec3& value)
+	{
+		SphericalHarmonics result;
+		result.coefficients[0] = value * PI / 0.886227f;
+		return result;
+	}
+
+	// 64-bit FNV-1a, used to key cached results to their source files
+	inline uint64_t HashFiles(const std::vector<std::string>& paths, uint64_t hash = 14695981039346656037ull)
+	{
+		std::vector<char> buffer(1 << 16);
+		for(const std::string& path : paths)
+		{
+			std::ifstream file(path, std::ios::binary);
+			while(file)
+			{
+				file.read(buffer.data(), buffer.size());
+				for(std::streamsize i = 0; i < file.gcount(); i++)
+				{
+					hash ^= static_cast<unsigned char>(buffer[i]);
+					hash *= 1099511628211ull;
+				}
+			}
+		}
+		return hash;
+	}
+}
@@ -0,0 +1,240 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Frustum culling and LOD selection on the GPU. Every object gets one thread in cull.csh,
+// which appends a draw command to its geometry's region of the command buffer for every
+// pass that sees it, counting them with atomics. Each pass then draws each geometry (a VAO
+// and element buffer) with one glMultiDrawElementsIndirectCount; without
+// ARB_indirect_parameters the regions are zeroed first and drawn whole with
+// glMultiDrawElementsIndirect. Vertex shaders find their object through gl_BaseInstanceARB,
+// so the CPU cost per frame is copying the objects, not culling and submitting them.
+// Needs GL 4.3 (compute shaders, storage buffers, multi-draw indirect) and ARB_shader_draw_parameters.
+class GpuCulling
+{
+public:
+	static const int MAX_LODS = 5;		// Mesh::MAX_LODS
+	static const GLuint WORKGROUP_SIZE = 64;
+	enum { PASS_MAIN, PASS_SHADOW, PASS_COUNT };
+
+	// std430 layouts of cull.csh, Object also of main.vsh and depth.vsh
+	struct Object
+	{
+		glm::mat4 model;
+		glm::vec4 boundsMin;		// world space, w = roughness
+		glm::vec4 boundsMax;		// w = largest scale of model, for the LOD error
+		glm::ivec4 material;		// diffuse, specular and normal map locations, geometry
+	};
+	struct Geometry
+	{
+		glm::uvec4 lods[MAX_LODS];	// first index, index count, error as float bits
+		glm::uvec4 info;			// LOD count, first command of its region
+	};
+	// Where a geometry's commands go, with room for every object using it this frame
+	struct Batch
+	{
+		GLuint vao, ebo;
+		GLuint firstCommand, capacity;
+	};
+	// The cameras of the passes, for cull.csh
+	struct View
+	{
+		glm::vec4 planes[PASS_COUNT][6];	// Frustum::planes
+		glm::vec3 position;		// LODs of both passes are picked from the camera's distance
+		GLfloat pixelsPerUnit;
+		GLfloat maxPixelError[PASS_COUNT];
+	};
+
+	static bool Supported()
+	{
+		bool compute = GLAD_GL_VERSION_4_3 || (GLAD_GL_ARB_compute_shader && GLAD_GL_ARB_shader_storage_buffer_object && GLAD_GL_ARB_multi_draw_indirect);
+		return compute && GLAD_GL_ARB_shader_draw_parameters;
+	}
+
+	// Main thread: the geometry drawn from this VAO and element buffer, -1 if it was not added yet
+	GLint FindGeometry(GLuint vao, GLuint ebo) const
+	{
+		auto found = geometryIndices.find({ vao, ebo });
+		return found == geometryIndices.end() ? -1 : found->second;
+	}
+
+	// Main thread: adds a geometry, followed by its LODs from the most detailed one
+	GLint AddGeometry(GLuint vao, GLuint ebo)
+	{
+		GLint geometry = GLint(geometries.size());
+		geometryIndices[{ vao, ebo }] = geometry;
+		Geometry entry;
+		for(glm::uvec4& lod : entry.lods)
+			lod = glm::uvec4(0);
+		entry.info = glm::uvec4(0);
+		geometries.push_back(entry);
+		batches.push_back({ vao, ebo, 0, 0 });
+		return geometry;
+	}
+	void AddLod(GLint geometry, GLuint firstIndex, GLsizei indexCount, GLfloat error)
+	{
+		Geometry& entry = geometries[geometry];
+		if(entry.info.x == MAX_LODS)
+			return;
+		uint32_t errorBits;
+		memcpy(&errorBits, &error, sizeof(errorBits));
+		entry.lods[entry.info.x++] = glm::uvec4(firstIndex, GLuint(indexCount), errorBits, 0);
+	}
+
+	// Main thread: the frame's copy of the geometries and batches, with room in each
+	// batch for the objects using it
+	void Record(const std::vector<Object>& objects, std::vector<Geometry>& frameGeometries, std::vector<Batch>& frameBatches) const
+	{
+		frameGeometries = geometries;
+		frameBatches = batches;
+		for(const Object& object : objects)
+			frameBatches[object.material.w].capacity++;
+		GLuint firstCommand = 0;
+		for(size_t i = 0; i < frameBatches.size(); i++)
+		{
+			frameBatches[i].firstCommand = firstCommand;
+			frameGeometries[i].info.y = firstCommand;
+			firstCommand += frameBatches[i].capacity;
+		}
+	}
+
+	// GL thread. false if cull.csh does not compile, the CPU path is used then.
+	bool Create(const std::string& computeShaderSource)
+	{
+		GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+		const char* source = computeShaderSource.c_str();
+		glShaderSource(shader, 1, &source, nullptr);
+		glCompileShader(shader);
+		program = glCreateProgram();
+		glAttachShader(program, shader);
+		glLinkProgram(program);
+		glDetachShader(program, shader);
+		glDeleteShader(shader);
+
+		GLint linkStatus;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+		if(linkStatus != GL_TRUE)
+		{
+			char infoLog[512];
+			GLsizei infoLogLen = sizeof(infoLog);
+			glGetProgramInfoLog(program, infoLogLen, &infoLogLen, infoLog);
+			std::cerr << "cull shader error: " << infoLog << std::endl;
+			glDeleteProgram(program);
+			program = 0;
+			return false;
+		}
+
+		glGenBuffers(1, &objectBuffer);
+		glGenBuffers(1, &geometryBuffer);
+		glGenBuffers(1, &commandBuffer);
+		glGenBuffers(1, &countBuffer);
+		drawCount = GLAD_GL_VERSION_4_6 || GLAD_GL_ARB_indirect_parameters;
+		return true;
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		GLuint buffers[] = { objectBuffer, geometryBuffer, commandBuffer, countBuffer };
+		glDeleteBuffers(4, buffers);
+		glDeleteProgram(program);
+		objectBuffer = geometryBuffer = commandBuffer = countBuffer = program = 0;
+	}
+
+	// GL thread: culls the frame's objects into the command buffer. The objects stay
+	// bound to storage binding 2 for the vertex shaders.
+	void Cull(const std::vector<Object>& objects, const std::vector<Geometry>& frameGeometries, const View& view)
+	{
+		objectCount = GLuint(objects.size());
+		geometryCount = GLuint(frameGeometries.size());
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(Object), objects.data(), GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, objectBuffer);
+		if(objectCount == 0)
+			return;
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, geometryBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, frameGeometries.size() * sizeof(Geometry), frameGeometries.data(), GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, geometryBuffer);
+
+		// every pass has room for all objects; without a draw count the unused commands must draw nothing
+		GLuint zero = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, PASS_COUNT * objects.size() * COMMAND_SIZE, nullptr, GL_STREAM_DRAW);
+		if(!drawCount)
+			glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, commandBuffer);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, PASS_COUNT * frameGeometries.size() * sizeof(GLuint), nullptr, GL_STREAM_DRAW);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, countBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		glUseProgram(program);
+		glUniform1ui(glGetUniformLocation(program, "objectCount"), objectCount);
+		glUniform1ui(glGetUniformLocation(program, "geometryCount"), geometryCount);
+		glUniform4fv(glGetUniformLocation(program, "planes"), PASS_COUNT * 6, &view.planes[0][0].x);
+		glUniform3fv(glGetUniformLocation(program, "viewPosition"), 1, &view.position.x);
+		glUniform1f(glGetUniformLocation(program, "pixelsPerUnit"), view.pixelsPerUnit);
+		glUniform1fv(glGetUniformLocation(program, "maxPixelError"), PASS_COUNT, view.maxPixelError);
+		glDispatchCompute((objectCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+	}
+
+	// GL thread: draws what Cull() left of the objects for pass, with the program in use
+	void Draw(int pass, const std::vector<Batch>& frameBatches) const
+	{
+		if(objectCount == 0)
+			return;
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		if(drawCount)
+			glBindBuffer(GL_PARAMETER_BUFFER, countBuffer);
+		for(size_t i = 0; i < frameBatches.size(); i++)
+		{
+			const Batch& batch = frameBatches[i];
+			if(batch.capacity == 0)
+				continue;
+			glBindVertexArray(batch.vao);
+			if(batch.ebo != 0)
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.ebo);
+
+			const void* commands = (const void*)(uintptr_t(pass * objectCount + batch.firstCommand) * COMMAND_SIZE);
+			GLintptr count = GLintptr(pass * geometryCount + i) * sizeof(GLuint);
+			if(GLAD_GL_VERSION_4_6)
+				glMultiDrawElementsIndirectCount(GL_TRIANGLES, GL_UNSIGNED_INT, commands, count, GLsizei(batch.capacity), 0);
+			else if(drawCount)
+				glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_INT, commands, count, GLsizei(batch.capacity), 0);
+			else
+				glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, commands, GLsizei(batch.capacity), 0);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		if(drawCount)
+			glBindBuffer(GL_PARAMETER_BUFFER, 0);
+	}
+
+private:
+	static const size_t COMMAND_SIZE = 5 * sizeof(GLuint);	// DrawElementsIndirectCommand
+
+	// main thread
+	std::map<std::pair<GLuint, GLuint>, GLint> geometryIndices;
+	std::vector<Geometry> geometries;
+	std::vector<Batch> batches;
+
+	// GL thread
+	GLuint program = 0;
+	GLuint objectBuffer = 0, geometryBuffer = 0, commandBuffer = 0, countBuffer = 0;
+	GLuint objectCount = 0, geometryCount = 0;
+	bool drawCount = false;
+};
@@ -0,0 +1,267 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts unfinished jobs. A job system Run() increments it, the job decrements it when done.
+// Wait on it (or make other jobs depend on it) to know when a group of jobs has finished.
+struct JobCounter
+{
+	std::atomic<int> pending{ 0 };
+
+	bool Done() const { return pending.load(std::memory_order_acquire) == 0; }
+};
+
+struct Job
+{
+	std::function<void()> work;
+	JobCounter* counter;		// decremented when the job finishes, may be null
+	JobCounter* dependency;	// job only starts once this is done, may be null
+};
+
+// Work-stealing job system.
+// Every worker owns a deque: it pushes and pops its own jobs at the back and
+// steals from the front of the other workers' deques when it runs dry.
+// The thread calling Wait() helps out instead of sleeping, so a job system
+// with 0 workers still works and simply runs everything on the calling thread.
+// Long running work (asset imports) goes through RunBackground() instead, which
+// only idle workers pick up so it never ends up inside somebody's Wait().
+// Workers with nothing to do spin briefly, then sleep until a job is queued.
+class JobSystem
+{
+public:
+	explicit JobSystem(unsigned int workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1)
+	{
+		// queue 0 belongs to the thread that created the job system
+		queues.resize(workerCount + 1);
+		for(auto& queue : queues)
+			queue.reset(new WorkQueue());
+
+		for(unsigned int i = 0; i < workerCount; i++)
+			workers.emplace_back(&JobSystem::workerLoop, this, i + 1);
+	}
+
+	~JobSystem()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			running = false;
+		}
+		wake.notify_all();
+		for(std::thread& worker : workers)
+			worker.join();
+	}
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	unsigned int ThreadCount() const { return static_cast<unsigned int>(queues.size()); }
+
+	// Queues a job. counter is incremented now and decremented when the job has run.
+	// If dependency is given the job does not start before that counter reaches zero.
+	void Run(std::function<void()> work, JobCounter* counter = nullptr, JobCounter* dependency = nullptr)
+	{
+		if(counter)
+			counter->pending.fetch_add(1, std::memory_order_relaxed);
+
+		WorkQueue& queue = *queues[queueIndex()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.jobs.push_back({ std::move(work), counter, dependency });
+		}
+		jobQueued();
+	}
+
+	// Queues a job that only worker threads run, when they have nothing else to do.
+	// Needs at least one worker.
+	void RunBackground(std::function<void()> work, JobCounter* counter = nullptr)
+	{
+		if(counter)
+			counter->pending.fetch_add(1, std::memory_order_relaxed);
+
+		{
+			std::lock_guard<std::mutex> lock(backgroundQueue.mutex);
+			backgroundQueue.jobs.push_back({ std::move(work), counter, nullptr });
+		}
+		jobQueued();
+	}
+
+	// Runs other jobs until counter reaches zero.
+	void Wait(const JobCounter& counter)
+	{
+		while(!counter.Done())
+		{
+			if(!runOneJob(queueIndex()))
+				std::this_thread::yield();
+		}
+	}
+
+	// Splits [begin, end) into chunks of at most grainSize and calls work(chunkBegin, chunkEnd)
+	// for each of them on the available threads. Returns once all chunks are done.
+	void ParallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& work)
+	{
+		if(begin >= end)
+			return;
+		grainSize = std::max<size_t>(grainSize, 1);
+
+		JobCounter counter;
+		for(size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grainSize)
+		{
+			size_t chunkEnd = std::min(chunkBegin + grainSize, end);
+			Run([&work, chunkBegin, chunkEnd] { work(chunkBegin, chunkEnd); }, &counter);
+		}
+		Wait(counter);
+	}
+
+	// ParallelFor for code that already runs in a background job: the chunks are background
+	// jobs too, so long ones never end up inside a frame's Wait(). Needs at least one worker.
+	void ParallelForBackground(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& work)
+	{
+		if(begin >= end)
+			return;
+		grainSize = std::max<size_t>(grainSize, 1);
+
+		JobCounter counter;
+		for(size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grainSize)
+		{
+			size_t chunkEnd = std::min(chunkBegin + grainSize, end);
+			RunBackground([&work, chunkBegin, chunkEnd] { work(chunkBegin, chunkEnd); }, &counter);
+		}
+		while(!counter.Done())
+		{
+			if(!runOneJob(queueIndex()) && !runBackgroundJob())
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	WorkQueue backgroundQueue;
+	std::vector<std::thread> workers;
+	std::atomic<bool> running{ true };
+
+	// idle workers sleep on wake until queuedJobs is non-zero
+	std::atomic<size_t> queuedJobs{ 0 };
+	std::atomic<unsigned int> sleepingWorkers{ 0 };
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+
+	// index of the queue owned by the calling thread, 0 for any thread that is not a worker
+	static unsigned int& currentQueue()
+	{
+		static thread_local unsigned int index = 0;
+		return index;
+	}
+	unsigned int queueIndex() const
+	{
+		return currentQueue() < queues.size() ? currentQueue() : 0;
+	}
+
+	void workerLoop(unsigned int index)
+	{
+		currentQueue() = index;
+
+		unsigned int idleSpins = 0;
+		while(running)
+		{
+			if(runOneJob(index) || runBackgroundJob())
+				idleSpins = 0;
+			else if(++idleSpins < 64)
+				std::this_thread::yield();
+			else
+			{
+				// sleep until something is queued; jobs put back for their dependency still count
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				sleepingWorkers.fetch_add(1);
+				wake.wait(lock, [this] { return !running || queuedJobs.load() > 0; });
+				sleepingWorkers.fetch_sub(1);
+				idleSpins = 0;
+			}
+		}
+	}
+
+	// Wakes a sleeping worker for a new job. Both sides use sequentially consistent atomics,
+	// so either the worker sees the job or we see the worker.
+	void jobQueued()
+	{
+		queuedJobs.fetch_add(1);
+		if(sleepingWorkers.load() == 0)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+
+	// Pops from the back of our own queue, otherwise steals from the front of another one.
+	// Jobs whose dependency is not done yet are put back at the front.
+	bool runOneJob(unsigned int ownIndex)
+	{
+		Job job;
+		if(!popJob(*queues[ownIndex], true, job))
+		{
+			bool stolen = false;
+			for(size_t i = 1; i < queues.size() && !stolen; i++)
+				stolen = popJob(*queues[(ownIndex + i) % queues.size()], false, job);
+			if(!stolen)
+				return false;
+		}
+
+		if(job.dependency && !job.dependency->Done())
+		{
+			WorkQueue& queue = *queues[ownIndex];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.jobs.push_front(std::move(job));
+			queuedJobs.fetch_add(1);
+			return false;
+		}
+
+		job.work();
+		if(job.counter)
+			job.counter->pending.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+
+	bool runBackgroundJob()
+	{
+		Job job;
+		if(!popJob(backgroundQueue, false, job))
+			return false;
+
+		job.work();
+		if(job.counter)
+			job.counter->pending.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+
+	bool popJob(WorkQueue& queue, bool fromBack, Job& job)
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if(queue.jobs.empty())
+			return false;
+
+		if(fromBack)
+		{
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+		} else
+		{
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+		queuedJobs.fetch_sub(1);
+		return true;
+	}
+};
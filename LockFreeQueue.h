@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue without locks.
+// Every cell carries a sequence number telling producers and consumers whose turn it is
+// (Dmitry Vyukov's bounded MPMC queue). Capacity has to be a power of two.
+template<typename T>
+class LockFreeQueue
+{
+public:
+	explicit LockFreeQueue(size_t capacity)
+		: cells(capacity), mask(capacity - 1)
+	{
+		for(size_t i = 0; i < capacity; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	LockFreeQueue(const LockFreeQueue&) = delete;
+	LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+	// Returns false if the queue is full
+	bool Push(const T& value)
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		Cell* cell;
+		while(true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if(difference == 0)
+			{
+				if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			} else if(difference < 0)
+				return false;
+			else
+				position = tail.load(std::memory_order_relaxed);
+		}
+
+		cell->value = value;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty
+	bool Pop(T& value)
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		Cell* cell;
+		while(true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+			if(difference == 0)
+			{
+				if(head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			} else if(difference < 0)
+				return false;
+			else
+				position = head.load(std::memory_order_relaxed);
+		}
+
+		value = cell->value;
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::vector<Cell> cells;
+	size_t mask;
+
+	// producers and consumers on separate cache lines
+	alignas(64) std::atomic<size_t> tail{ 0 };
+	alignas(64) std::atomic<size_t> head{ 0 };
+};
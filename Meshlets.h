@@ -0,0 +1,185 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// A small cluster of a mesh's triangles, contiguous in its index list, with the bounds
+// needed to cull it on its own: a bounding sphere and a cone around the triangle normals.
+struct Meshlet
+{
+	unsigned int firstIndex;
+	unsigned int indexCount;
+	glm::vec3 center;		// model space
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff;		// sine of the cone's half angle, 1 if it is too wide to cull anything
+
+	// true if every triangle faces away from a viewer at this position (model space)
+	bool FacesAway(const glm::vec3& viewPosition) const
+	{
+		if(coneCutoff >= 1.0f)
+			return false;
+		glm::vec3 toCenter = center - viewPosition;
+		return glm::dot(toCenter, coneAxis) >= coneCutoff * glm::length(toCenter) + radius;
+	}
+};
+
+const size_t MESHLET_MAX_VERTICES = 64;
+const size_t MESHLET_MAX_TRIANGLES = 124;
+const float MESHLET_MIN_FACING = 0.6f;	// cosine between a triangle's normal and its meshlet's, about 53 degrees
+
+// Reorders the triangles of indices[first, first + count) into meshlets and appends them.
+// A meshlet grows from a seed triangle through its neighbours (triangles sharing a position),
+// preferring the ones that add few vertices and face the same way, and never taking one that
+// turns too far away, so its normal cone stays narrow enough to be culled.
+inline void BuildMeshlets(const std::vector<glm::vec3>& positions, std::vector<unsigned int>& indices, size_t first, size_t count,
+	std::vector<Meshlet>& result)
+{
+	size_t triangleCount = count / 3;
+	if(triangleCount == 0)
+		return;
+
+	// vertices that share a position connect triangles, even across attribute seams
+	std::vector<unsigned int> positionIds(count);
+	std::unordered_map<uint64_t, unsigned int> ids;
+	std::vector<glm::vec3> normals(triangleCount);
+	for(size_t i = 0; i < count; i++)
+	{
+		const glm::vec3& p = positions[indices[first + i]];
+		uint32_t bits[3];
+		std::memcpy(bits, &p, sizeof(bits));
+		uint64_t key = (uint64_t(bits[0]) * 73856093u) ^ (uint64_t(bits[1]) * 19349663u << 16) ^ (uint64_t(bits[2]) * 83492791u << 32);
+		positionIds[i] = ids.emplace(key, unsigned(ids.size())).first->second;
+	}
+	for(size_t t = 0; t < triangleCount; t++)
+	{
+		const glm::vec3& p0 = positions[indices[first + t * 3]];
+		glm::vec3 normal = glm::cross(positions[indices[first + t * 3 + 1]] - p0, positions[indices[first + t * 3 + 2]] - p0);
+		float length = glm::length(normal);
+		normals[t] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+	}
+
+	// triangles around each position
+	std::vector<unsigned int> offsets(ids.size() + 1, 0), adjacency(count);
+	for(unsigned int id : positionIds)
+		offsets[id + 1]++;
+	for(size_t id = 0; id < ids.size(); id++)
+		offsets[id + 1] += offsets[id];
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for(size_t i = 0; i < count; i++)
+		adjacency[fill[positionIds[i]]++] = unsigned(i / 3);
+
+	std::vector<unsigned int> ordered;
+	ordered.reserve(count);
+	std::vector<uint8_t> emitted(triangleCount, 0);
+	std::vector<unsigned int> vertices, triangles, frontier;
+	size_t nextSeed = 0;
+	auto newVertexCount = [&](size_t t)
+	{
+		size_t added = 0;
+		for(int k = 0; k < 3; k++)
+		{
+			if(std::find(vertices.begin(), vertices.end(), indices[first + t * 3 + k]) == vertices.end())
+				added++;
+		}
+		return added;
+	};
+
+	while(true)
+	{
+		while(nextSeed < triangleCount && emitted[nextSeed])
+			nextSeed++;
+		if(nextSeed == triangleCount)
+			break;
+
+		vertices.clear();
+		triangles.clear();
+		frontier.assign(1, unsigned(nextSeed));
+		glm::vec3 normalSum(0.0f);
+		while(triangles.size() < MESHLET_MAX_TRIANGLES && !frontier.empty())
+		{
+			// the neighbour that keeps the meshlet smallest and flattest
+			glm::vec3 axis = glm::length(normalSum) > 0.0f ? glm::normalize(normalSum) : glm::vec3(0.0f);
+			size_t best = frontier.size();
+			float bestScore = -FLT_MAX;
+			for(size_t i = 0; i < frontier.size(); i++)
+			{
+				size_t added = newVertexCount(frontier[i]);
+				if(vertices.size() + added > MESHLET_MAX_VERTICES)
+					continue;
+				float facing = glm::dot(normals[frontier[i]], axis);
+				if(!triangles.empty() && facing < MESHLET_MIN_FACING)
+					continue;
+				float score = facing - 0.5f * added;
+				if(score > bestScore)
+				{
+					bestScore = score;
+					best = i;
+				}
+			}
+			if(best == frontier.size())
+				break;
+
+			unsigned int t = frontier[best];
+			frontier[best] = frontier.back();
+			frontier.pop_back();
+			emitted[t] = 1;
+			triangles.push_back(t);
+			normalSum += normals[t];
+			for(int k = 0; k < 3; k++)
+			{
+				unsigned int vertex = indices[first + t * 3 + k];
+				if(std::find(vertices.begin(), vertices.end(), vertex) == vertices.end())
+					vertices.push_back(vertex);
+				unsigned int id = positionIds[t * 3 + k];
+				for(unsigned int a = offsets[id]; a < offsets[id + 1]; a++)
+				{
+					unsigned int neighbour = adjacency[a];
+					if(!emitted[neighbour] && std::find(frontier.begin(), frontier.end(), neighbour) == frontier.end())
+						frontier.push_back(neighbour);
+				}
+			}
+		}
+
+		Meshlet meshlet;
+		meshlet.firstIndex = unsigned(first + ordered.size());
+		meshlet.indexCount = unsigned(triangles.size() * 3);
+		for(unsigned int t : triangles)
+		{
+			for(int k = 0; k < 3; k++)
+				ordered.push_back(indices[first + t * 3 + k]);
+		}
+
+		// sphere around the vertices' box
+		glm::vec3 min(positions[vertices[0]]), max(positions[vertices[0]]);
+		for(unsigned int vertex : vertices)
+		{
+			min = glm::min(min, positions[vertex]);
+			max = glm::max(max, positions[vertex]);
+		}
+		meshlet.center = (min + max) * 0.5f;
+		meshlet.radius = 0.0f;
+		for(unsigned int vertex : vertices)
+			meshlet.radius = std::max(meshlet.radius, glm::length(positions[vertex] - meshlet.center));
+
+		// cone around the normals: their average as the axis, the widest one sets the angle
+		float axisLength = glm::length(normalSum);
+		meshlet.coneAxis = axisLength > 0.0f ? normalSum / axisLength : glm::vec3(0.0f, 0.0f, 1.0f);
+		float minDot = axisLength > 0.0f ? 1.0f : -1.0f;
+		for(unsigned int t : triangles)
+		{
+			if(glm::length(normals[t]) > 0.0f)
+				minDot = std::min(minDot, glm::dot(normals[t], meshlet.coneAxis));
+		}
+		meshlet.coneCutoff = minDot <= 0.0f ? 1.0f : std::sqrt(1.0f - minDot * minDot);
+		result.push_back(meshlet);
+	}
+
+	std::copy(ordered.begin(), ordered.end(), indices.begin() + first);
+}
@@ -0,0 +1,667 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "JobSystem.h"
+
+// Wavefront OBJ/MTL importer for the common case: the file is memory mapped, cut into chunks
+// at line boundaries and the chunks are parsed in parallel. Faces are split into a mesh per
+// object and material like Assimp's importer does, fan triangulated, and every distinct
+// position/UV/normal combination becomes one vertex. UVs are flipped to match aiProcess_FlipUVs.
+// Anything it does not understand makes Load() fail, so the caller can fall back to Assimp.
+namespace obj
+{
+	// Same defaults as Assimp's OBJ importer, for usemtl names the library does not have
+	struct Material
+	{
+		std::string name;
+		glm::vec3 diffuse = glm::vec3(0.6f);
+		float shininess = 0.0f;
+		// relative to the model file, empty when there is none
+		std::string diffuseMap, specularMap, normalMap;
+	};
+
+	template<typename Vertex>
+	struct Mesh
+	{
+		int material = -1;		// into the materials Load() returns, -1 for the default one
+		bool hasUVs = false;
+		std::vector<Vertex> vertices;
+		std::vector<unsigned int> indices;
+	};
+
+	// A read-only view of a whole file
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& path)
+		{
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if(file == INVALID_HANDLE_VALUE)
+				return;
+			LARGE_INTEGER fileSize;
+			if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+				return;
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if(!mapping)
+				return;
+			data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			size = data ? size_t(fileSize.QuadPart) : 0;
+#else
+			int file = open(path.c_str(), O_RDONLY);
+			if(file == -1)
+				return;
+			struct stat info;
+			if(fstat(file, &info) == 0 && info.st_size > 0)
+			{
+				void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+				if(view != MAP_FAILED)
+				{
+					data = static_cast<const char*>(view);
+					size = size_t(info.st_size);
+				}
+			}
+			close(file);
+#endif
+		}
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if(data)
+				UnmapViewOfFile(data);
+			if(mapping)
+				CloseHandle(mapping);
+			if(file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+#else
+			if(data)
+				munmap(const_cast<char*>(data), size);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const char* Data() const { return data; }
+		size_t Size() const { return size; }
+
+	private:
+		const char* data = nullptr;
+		size_t size = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+
+	const size_t CHUNK_SIZE = 256 * 1024;
+
+	inline bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	inline const char* SkipSpaces(const char* p, const char* end)
+	{
+		while(p < end && IsSpace(*p))
+			p++;
+		return p;
+	}
+
+	// Decimal float without locale or errno handling, the 19 leading significant digits go into
+	// an integer that is scaled by an exact power of ten once. Returns p unchanged if there is no number.
+	inline const char* ParseFloat(const char* p, const char* end, float& value)
+	{
+		static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		const char* start = p;
+		bool negative = p < end && *p == '-';
+		if(p < end && (*p == '-' || *p == '+'))
+			p++;
+
+		uint64_t mantissa = 0;
+		int digits = 0, exponent = 0;
+		const char* firstDigit = p;
+		for(; p < end && unsigned(*p - '0') < 10; p++)
+		{
+			if(digits < 19)
+			{
+				mantissa = mantissa * 10 + unsigned(*p - '0');
+				digits += mantissa != 0;
+			} else
+				exponent++;
+		}
+		if(p < end && *p == '.')
+		{
+			for(p++; p < end && unsigned(*p - '0') < 10; p++)
+			{
+				if(digits < 19)
+				{
+					mantissa = mantissa * 10 + unsigned(*p - '0');
+					digits += mantissa != 0;
+					exponent--;
+				}
+			}
+		}
+		if(p == firstDigit || (p == firstDigit + 1 && *firstDigit == '.'))
+			return start;
+
+		if(p < end && (*p == 'e' || *p == 'E'))
+		{
+			const char* e = p + 1;
+			bool negativeExponent = e < end && *e == '-';
+			if(e < end && (*e == '-' || *e == '+'))
+				e++;
+			if(e < end && unsigned(*e - '0') < 10)
+			{
+				int written = 0;
+				for(; e < end && unsigned(*e - '0') < 10; e++)
+					written = std::min(written * 10 + int(*e - '0'), 10000);
+				exponent += negativeExponent ? -written : written;
+				p = e;
+			}
+		}
+
+		double result = double(mantissa);
+		for(; exponent > 22; exponent -= 22)
+			result *= 1e22;
+		for(; exponent < -22; exponent += 22)
+			result /= 1e22;
+		result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+		value = float(negative ? -result : result);
+		return p;
+	}
+
+	inline const char* ParseInt(const char* p, const char* end, int& value)
+	{
+		bool negative = p < end && *p == '-';
+		if(p < end && (*p == '-' || *p == '+'))
+			p++;
+		int64_t result = 0;
+		for(; p < end && unsigned(*p - '0') < 10; p++)
+			result = std::min<int64_t>(result * 10 + (*p - '0'), INT_MAX);
+		value = int(negative ? -result : result);
+		return p;
+	}
+
+	// The rest of the line without surrounding spaces
+	inline std::string RestOfLine(const char* p, const char* end)
+	{
+		p = SkipSpaces(p, end);
+		while(end > p && IsSpace(end[-1]))
+			end--;
+		return std::string(p, end);
+	}
+
+	inline bool StartsWith(const char* p, const char* end, const char* keyword)
+	{
+		size_t length = strlen(keyword);
+		return size_t(end - p) > length && memcmp(p, keyword, length) == 0 && IsSpace(p[length]);
+	}
+
+	// Material library next to the model. Texture options (-bm 1.0 and the like) are skipped,
+	// the file name is what follows them.
+	inline void LoadMaterials(const std::string& path, std::vector<Material>& materials)
+	{
+		MappedFile file(path);
+		if(!file.Data())
+		{
+			std::cerr << "ERROR::OBJ:: material library " << path << " not found" << std::endl;
+			return;
+		}
+
+		auto mapName = [](const char* p, const char* end)
+		{
+			p = SkipSpaces(p, end);
+			while(p < end && *p == '-')
+			{
+				// an option and its numeric arguments
+				while(p < end && !IsSpace(*p))
+					p++;
+				p = SkipSpaces(p, end);
+				float ignored;
+				for(const char* next; p < end && (next = ParseFloat(p, end, ignored)) != p && (next == end || IsSpace(*next)); )
+					p = SkipSpaces(next, end);
+			}
+			std::string name = RestOfLine(p, end);
+			std::replace(name.begin(), name.end(), '\\', '/');
+			return name;
+		};
+
+		const char* data = file.Data();
+		const char* fileEnd = data + file.Size();
+		for(const char* line = data; line < fileEnd; )
+		{
+			const char* lineEnd = static_cast<const char*>(memchr(line, '\n', size_t(fileEnd - line)));
+			if(!lineEnd)
+				lineEnd = fileEnd;
+			const char* p = SkipSpaces(line, lineEnd);
+			line = lineEnd + 1;
+
+			if(StartsWith(p, lineEnd, "newmtl"))
+			{
+				materials.emplace_back();
+				materials.back().name = RestOfLine(p + 6, lineEnd);
+			}
+			if(materials.empty())
+				continue;
+
+			Material& material = materials.back();
+			if(StartsWith(p, lineEnd, "Kd"))
+			{
+				p += 2;
+				for(int i = 0; i < 3; i++)
+					p = ParseFloat(SkipSpaces(p, lineEnd), lineEnd, material.diffuse[i]);
+			} else if(StartsWith(p, lineEnd, "Ns"))
+				ParseFloat(SkipSpaces(p + 2, lineEnd), lineEnd, material.shininess);
+			else if(StartsWith(p, lineEnd, "map_Kd"))
+				material.diffuseMap = mapName(p + 6, lineEnd);
+			else if(StartsWith(p, lineEnd, "map_Ks"))
+				material.specularMap = mapName(p + 6, lineEnd);
+			// normal maps usually go into map_Bump
+			else if(StartsWith(p, lineEnd, "map_Bump") || StartsWith(p, lineEnd, "map_bump"))
+				material.normalMap = mapName(p + 8, lineEnd);
+			else if(StartsWith(p, lineEnd, "bump") || StartsWith(p, lineEnd, "norm"))
+				material.normalMap = mapName(p + 4, lineEnd);
+		}
+	}
+
+	// One face corner: position, UV and normal index. Negative indices count back from the
+	// end of the chunk's own list and are made absolute once every chunk is parsed.
+	struct Corner
+	{
+		int index[3];
+	};
+	const int MISSING = INT_MIN;
+
+	// Starts a new mesh at face, for o, g and usemtl lines
+	struct Switch
+	{
+		size_t face;
+		bool material;		// otherwise a new object
+		std::string name;
+	};
+
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		std::vector<glm::vec3> positions, normals;
+		std::vector<glm::vec2> uvs;
+		std::vector<Corner> corners;
+		std::vector<uint32_t> faceStarts;	// into corners, with one past the last face at the end
+		std::vector<uint8_t> relative;	// per corner, a bit for every index that counts back
+		std::vector<Switch> switches;
+		std::string library;
+		size_t firstPosition = 0, firstUV = 0, firstNormal = 0;
+		bool failed = false;
+	};
+
+	inline void ParseChunk(Chunk& chunk)
+	{
+		for(const char* line = chunk.begin; line < chunk.end && !chunk.failed; )
+		{
+			const char* lineEnd = static_cast<const char*>(memchr(line, '\n', size_t(chunk.end - line)));
+			if(!lineEnd)
+				lineEnd = chunk.end;
+			const char* p = SkipSpaces(line, lineEnd);
+			line = lineEnd + 1;
+			if(p + 1 >= lineEnd)
+				continue;
+
+			if(p[0] == 'v' && IsSpace(p[1]))
+			{
+				glm::vec3 position;
+				p += 2;
+				for(int i = 0; i < 3; i++)
+				{
+					const char* next = ParseFloat(SkipSpaces(p, lineEnd), lineEnd, position[i]);
+					chunk.failed |= next == p;
+					p = next;
+				}
+				chunk.positions.push_back(position);
+			} else if(p[0] == 'v' && p[1] == 't')
+			{
+				glm::vec2 uv(0.0f);
+				p = ParseFloat(SkipSpaces(p + 2, lineEnd), lineEnd, uv.x);
+				ParseFloat(SkipSpaces(p, lineEnd), lineEnd, uv.y);
+				chunk.uvs.push_back(uv);
+			} else if(p[0] == 'v' && p[1] == 'n')
+			{
+				glm::vec3 normal;
+				p += 2;
+				for(int i = 0; i < 3; i++)
+				{
+					const char* next = ParseFloat(SkipSpaces(p, lineEnd), lineEnd, normal[i]);
+					chunk.failed |= next == p;
+					p = next;
+				}
+				chunk.normals.push_back(normal);
+			} else if(p[0] == 'f' && IsSpace(p[1]))
+			{
+				chunk.faceStarts.push_back(uint32_t(chunk.corners.size()));
+				size_t counts[3] = { chunk.positions.size(), chunk.uvs.size(), chunk.normals.size() };
+				for(p = SkipSpaces(p + 2, lineEnd); p < lineEnd; p = SkipSpaces(p, lineEnd))
+				{
+					// v, v/vt, v//vn or v/vt/vn
+					Corner corner = { { MISSING, MISSING, MISSING } };
+					uint8_t relative = 0;
+					for(int i = 0; i < 3 && p < lineEnd && !IsSpace(*p); i++)
+					{
+						if(*p != '/')
+						{
+							int index;
+							const char* next = ParseInt(p, lineEnd, index);
+							if(next == p || index == 0)
+							{
+								chunk.failed = true;
+								return;
+							}
+							p = next;
+							if(index < 0)
+							{
+								corner.index[i] = int(counts[i]) + index;
+								relative |= 1 << i;
+							} else
+								corner.index[i] = index - 1;
+						}
+						if(p < lineEnd && *p == '/')
+							p++;
+					}
+					chunk.failed |= corner.index[0] == MISSING;
+					chunk.corners.push_back(corner);
+					chunk.relative.push_back(relative);
+				}
+				if(chunk.corners.size() - chunk.faceStarts.back() < 3)
+				{
+					// points and lines are not drawn
+					chunk.corners.resize(chunk.faceStarts.back());
+					chunk.relative.resize(chunk.faceStarts.back());
+					chunk.faceStarts.pop_back();
+				}
+			} else if((p[0] == 'o' || p[0] == 'g') && IsSpace(p[1]))
+				chunk.switches.push_back({ chunk.faceStarts.size(), false, RestOfLine(p + 1, lineEnd) });
+			else if(StartsWith(p, lineEnd, "usemtl"))
+				chunk.switches.push_back({ chunk.faceStarts.size(), true, RestOfLine(p + 6, lineEnd) });
+			else if(StartsWith(p, lineEnd, "mtllib") && chunk.library.empty())
+				chunk.library = RestOfLine(p + 6, lineEnd);
+		}
+		chunk.faceStarts.push_back(uint32_t(chunk.corners.size()));
+	}
+
+	// Open addressing table from a face corner to its vertex
+	class CornerTable
+	{
+	public:
+		explicit CornerTable(size_t cornerCount)
+		{
+			size_t capacity = 16;
+			while(capacity < cornerCount * 2)
+				capacity *= 2;
+			slots.assign(capacity, { { { MISSING, MISSING, MISSING } }, 0 });
+			mask = capacity - 1;
+		}
+
+		// The vertex of corner, or newVertex if it was not seen before
+		unsigned int Insert(const Corner& corner, unsigned int newVertex)
+		{
+			uint32_t hash = uint32_t(corner.index[0]) * 0x9E3779B1u ^ uint32_t(corner.index[1]) * 0x85EBCA77u ^ uint32_t(corner.index[2]) * 0xC2B2AE3Du;
+			for(size_t slot = (hash ^ hash >> 15) & mask; ; slot = (slot + 1) & mask)
+			{
+				Slot& entry = slots[slot];
+				if(entry.corner.index[0] == MISSING)
+				{
+					entry.corner = corner;
+					entry.vertex = newVertex;
+					return newVertex;
+				}
+				if(memcmp(&entry.corner, &corner, sizeof(Corner)) == 0)
+					return entry.vertex;
+			}
+		}
+
+	private:
+		struct Slot
+		{
+			Corner corner;
+			unsigned int vertex;
+		};
+		std::vector<Slot> slots;
+		size_t mask;
+	};
+
+	// Loads path into a mesh per object and material. makeVertex(position, normal, uv, material)
+	// turns a distinct corner into the caller's vertex format. false if the file is missing or
+	// has something in it this loader does not handle, nothing is returned then.
+	// Its chunks run as background jobs, call it from one.
+	template<typename Vertex, typename MakeVertex>
+	bool Load(const std::string& path, JobSystem& jobs, std::vector<Material>& materials, std::vector<Mesh<Vertex>>& meshes,
+		MakeVertex makeVertex)
+	{
+		MappedFile file(path);
+		if(!file.Data())
+			return false;
+
+		// chunks end after the first line break past their nominal size
+		std::vector<Chunk> chunks;
+		const char* data = file.Data();
+		const char* fileEnd = data + file.Size();
+		for(const char* begin = data; begin < fileEnd; )
+		{
+			const char* end = begin + std::min(CHUNK_SIZE, size_t(fileEnd - begin));
+			const char* lineBreak = end < fileEnd ? static_cast<const char*>(memchr(end, '\n', size_t(fileEnd - end))) : nullptr;
+			end = lineBreak ? lineBreak + 1 : fileEnd;
+			chunks.emplace_back();
+			chunks.back().begin = begin;
+			chunks.back().end = end;
+			begin = end;
+		}
+		jobs.ParallelForBackground(0, chunks.size(), 1, [&](size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; i++)
+				ParseChunk(chunks[i]);
+		});
+
+		// every chunk's indices start where the previous chunks' lists end
+		std::vector<glm::vec3> positions, normals;
+		std::vector<glm::vec2> uvs;
+		std::string library;
+		for(Chunk& chunk : chunks)
+		{
+			if(chunk.failed)
+			{
+				std::cerr << "ERROR::OBJ:: unsupported record in " << path << std::endl;
+				return false;
+			}
+			chunk.firstPosition = positions.size();
+			chunk.firstUV = uvs.size();
+			chunk.firstNormal = normals.size();
+			positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+			uvs.insert(uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+			normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+			if(library.empty())
+				library = chunk.library;
+		}
+		std::atomic<bool> valid{ true };
+		jobs.ParallelForBackground(0, chunks.size(), 1, [&](size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; i++)
+			{
+				Chunk& chunk = chunks[i];
+				size_t firsts[3] = { chunk.firstPosition, chunk.firstUV, chunk.firstNormal };
+				size_t counts[3] = { positions.size(), uvs.size(), normals.size() };
+				for(size_t c = 0; c < chunk.corners.size(); c++)
+				{
+					for(int k = 0; k < 3; k++)
+					{
+						int& index = chunk.corners[c].index[k];
+						if(index == MISSING)
+							continue;
+						if(chunk.relative[c] & (1 << k))
+							index += int(firsts[k]);
+						if(index < 0 || size_t(index) >= counts[k])
+							valid = false;
+					}
+				}
+			}
+		});
+		if(!valid)
+		{
+			std::cerr << "ERROR::OBJ:: face index out of range in " << path << std::endl;
+			return false;
+		}
+
+		size_t slash = path.find_last_of("/\\");
+		std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+		if(!library.empty())
+			LoadMaterials(directory + "/" + library, materials);
+		auto findMaterial = [&](const std::string& name)
+		{
+			for(size_t i = 0; i < materials.size(); i++)
+			{
+				if(materials[i].name == name)
+					return int(i);
+			}
+			return -1;
+		};
+
+		// faces in file order, a new mesh wherever the object or the material changes
+		struct Range
+		{
+			const Chunk* chunk;
+			size_t firstFace, endFace;
+		};
+		struct Group
+		{
+			int material;
+			std::vector<Range> ranges;
+			size_t cornerCount = 0;
+		};
+		std::vector<Group> groups(1, Group{ -1 });
+		for(const Chunk& chunk : chunks)
+		{
+			size_t face = 0;
+			size_t faceCount = chunk.faceStarts.size() - 1;
+			auto addFaces = [&](size_t end)
+			{
+				if(end > face)
+				{
+					groups.back().ranges.push_back({ &chunk, face, end });
+					groups.back().cornerCount += chunk.faceStarts[end] - chunk.faceStarts[face];
+				}
+				face = end;
+			};
+			for(const Switch& change : chunk.switches)
+			{
+				addFaces(change.face);
+				int material = change.material ? findMaterial(change.name) : groups.back().material;
+				if(!groups.back().ranges.empty())
+					groups.push_back(Group{ material });
+				groups.back().material = material;
+			}
+			addFaces(faceCount);
+		}
+		if(groups.back().ranges.empty())
+			groups.pop_back();
+
+		// every mesh deduplicates its own corners
+		meshes.resize(groups.size());
+		Material defaultMaterial;
+		jobs.ParallelForBackground(0, groups.size(), 1, [&](size_t begin, size_t end)
+		{
+			for(size_t g = begin; g < end; g++)
+			{
+				const Group& group = groups[g];
+				Mesh<Vertex>& mesh = meshes[g];
+				const Material& material = group.material >= 0 ? materials[group.material] : defaultMaterial;
+				mesh.material = group.material;
+
+				CornerTable table(group.cornerCount);
+				std::vector<Corner> unique;
+				std::vector<unsigned int> faceVertices;
+				for(const Range& range : group.ranges)
+				{
+					const Chunk& chunk = *range.chunk;
+					for(size_t face = range.firstFace; face < range.endFace; face++)
+					{
+						faceVertices.clear();
+						for(uint32_t c = chunk.faceStarts[face]; c < chunk.faceStarts[face + 1]; c++)
+						{
+							unsigned int vertex = table.Insert(chunk.corners[c], unsigned(unique.size()));
+							if(vertex == unique.size())
+								unique.push_back(chunk.corners[c]);
+							faceVertices.push_back(vertex);
+						}
+						for(size_t k = 1; k + 1 < faceVertices.size(); k++)
+						{
+							mesh.indices.push_back(faceVertices[0]);
+							mesh.indices.push_back(faceVertices[k]);
+							mesh.indices.push_back(faceVertices[k + 1]);
+						}
+					}
+				}
+
+				// corners without a normal get the area weighted average of their faces'
+				std::vector<glm::vec3> smoothNormals;
+				for(const Corner& corner : unique)
+				{
+					mesh.hasUVs |= corner.index[1] != MISSING;
+					if(corner.index[2] == MISSING && smoothNormals.empty())
+						smoothNormals.assign(unique.size(), glm::vec3(0.0f));
+				}
+				if(!smoothNormals.empty())
+				{
+					for(size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+					{
+						const glm::vec3& p0 = positions[unique[mesh.indices[i]].index[0]];
+						glm::vec3 normal = glm::cross(positions[unique[mesh.indices[i + 1]].index[0]] - p0, positions[unique[mesh.indices[i + 2]].index[0]] - p0);
+						for(int k = 0; k < 3; k++)
+							smoothNormals[mesh.indices[i + k]] += normal;
+					}
+				}
+
+				mesh.vertices.reserve(unique.size());
+				for(size_t v = 0; v < unique.size(); v++)
+				{
+					const Corner& corner = unique[v];
+					glm::vec3 normal;
+					if(corner.index[2] != MISSING)
+						normal = normals[corner.index[2]];
+					else
+					{
+						float length = glm::length(smoothNormals[v]);
+						normal = length > 0.0f ? smoothNormals[v] / length : glm::vec3(0.0f, 1.0f, 0.0f);
+					}
+					glm::vec2 uv(0.0f);
+					if(corner.index[1] != MISSING)
+						uv = glm::vec2(uvs[corner.index[1]].x, 1.0f - uvs[corner.index[1]].y);
+					mesh.vertices.push_back(makeVertex(positions[corner.index[0]], normal, uv, material));
+				}
+			}
+		});
+		return true;
+	}
+}
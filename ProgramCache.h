@@ -0,0 +1,167 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// On-disk cache of linked program binaries (GL 4.1 / ARB_get_program_binary).
+// Programs are keyed by a hash of everything that goes into them (sources, defines)
+// plus the driver's vendor, renderer and version strings, so a driver update simply
+// misses and the program is compiled again. All entries live in one file.
+// Without binary format support the cache stays disabled and Load() always misses.
+// Load() and Store() may be called from the shader compiler's worker thread.
+class ProgramCache
+{
+public:
+	// Needs the GL context
+	void Open(const std::string& path)
+	{
+		this->path = path;
+
+		GLint formatCount = 0;
+		if(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+		enabled = formatCount > 0;
+		if(!enabled)
+			return;
+
+		for(GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+		{
+			const GLubyte* value = glGetString(name);
+			driver += value ? reinterpret_cast<const char*>(value) : "";
+			driver += '\n';
+		}
+
+		std::ifstream file(path, std::ios::binary);
+		uint32_t magic = 0, count = 0;
+		file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+		file.read(reinterpret_cast<char*>(&count), sizeof(count));
+		if(!file || magic != CACHE_MAGIC)
+			return;
+		for(uint32_t i = 0; i < count; i++)
+		{
+			uint64_t key;
+			Entry entry;
+			uint32_t length;
+			file.read(reinterpret_cast<char*>(&key), sizeof(key));
+			file.read(reinterpret_cast<char*>(&entry.format), sizeof(entry.format));
+			file.read(reinterpret_cast<char*>(&length), sizeof(length));
+			if(!file)
+				break;
+			entry.binary.resize(length);
+			file.read(entry.binary.data(), length);
+			if(!file)
+				break;
+			entries[key] = std::move(entry);
+		}
+	}
+
+	bool Enabled() const { return enabled; }
+
+	// 64-bit FNV-1a over the driver strings and parts, in order
+	uint64_t Key(const std::vector<std::string>& parts) const
+	{
+		uint64_t hash = 14695981039346656037ull;
+		auto add = [&hash](const std::string& text)
+		{
+			for(unsigned char c : text)
+			{
+				hash ^= c;
+				hash *= 1099511628211ull;
+			}
+			// separator so ("ab", "c") and ("a", "bc") differ
+			hash ^= 0xFF;
+			hash *= 1099511628211ull;
+		};
+		add(driver);
+		for(const std::string& part : parts)
+			add(part);
+		return hash;
+	}
+
+	// Returns a linked program restored from the cache, or 0 if it is missing or the driver rejects it
+	GLuint Load(uint64_t key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(key);
+		if(!enabled || found == entries.end())
+			return 0;
+
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, found->second.format, found->second.binary.data(), static_cast<GLsizei>(found->second.binary.size()));
+		GLint linkStatus;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+		if(linkStatus != GL_TRUE)
+		{
+			glDeleteProgram(program);
+			entries.erase(found);
+			return 0;
+		}
+		return program;
+	}
+
+	// Call before linking a program that is going to be stored
+	void PrepareForStore(GLuint program)
+	{
+		if(enabled)
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	// Stores a linked program and rewrites the cache file
+	void Store(uint64_t key, GLuint program)
+	{
+		if(!enabled)
+			return;
+
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if(length <= 0)
+			return;
+
+		Entry entry;
+		entry.binary.resize(length);
+		glGetProgramBinary(program, length, nullptr, &entry.format, entry.binary.data());
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[key] = std::move(entry);
+		save();
+	}
+
+private:
+	static const uint32_t CACHE_MAGIC = 0x48435250;	// "PRCH"
+
+	struct Entry
+	{
+		GLenum format = 0;
+		std::vector<char> binary;
+	};
+
+	std::string path;
+	bool enabled = false;
+	std::string driver;
+	std::map<uint64_t, Entry> entries;
+	std::mutex mutex;
+
+	void save()
+	{
+		std::ofstream file(path, std::ios::binary);
+		uint32_t magic = CACHE_MAGIC;
+		uint32_t count = static_cast<uint32_t>(entries.size());
+		file.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+		file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		for(const auto& pair : entries)
+		{
+			uint32_t length = static_cast<uint32_t>(pair.second.binary.size());
+			file.write(reinterpret_cast<const char*>(&pair.first), sizeof(pair.first));
+			file.write(reinterpret_cast<const char*>(&pair.second.format), sizeof(pair.second.format));
+			file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+			file.write(pair.second.binary.data(), length);
+		}
+		if(!file)
+			std::cerr << "ERROR writing program cache " << path << "\n";
+	}
+};
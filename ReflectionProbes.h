@@ -0,0 +1,185 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Culling.h"
+
+// A point the scene is rendered from into a cubemap, for local reflections.
+// If box is valid, reflections are parallax corrected against it (the walls of a room).
+struct ReflectionProbe
+{
+	glm::vec3 position;
+	AABB box;
+};
+
+// Cubemap array holding the reflection probes, layer = probe * 6 + face.
+// Probes are refreshed a few faces at a time: the main thread schedules as many faces
+// per frame as fit in the GPU time budget (at least one), measured with timer queries
+// by the render thread. A probe is only sampled once all its faces have been rendered.
+class ReflectionProbes
+{
+public:
+	static const int PROBE_COUNT = 2;
+	static const int SIZE = 128;
+	static const int LEVELS = 6;
+	static constexpr float BUDGET_MILLISECONDS = 1.0f;
+
+	// GL thread
+	void Create()
+	{
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, texture);
+		if(GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage)
+			glTexStorage3D(GL_TEXTURE_CUBE_MAP_ARRAY, LEVELS, GL_RGBA8, SIZE, SIZE, PROBE_COUNT * 6);
+		else
+		{
+			for(int level = 0; level < LEVELS; ++level)
+				glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, level, GL_RGBA8, SIZE >> level, SIZE >> level, PROBE_COUNT * 6, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+		glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAX_LEVEL, LEVELS - 1);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, SIZE, SIZE);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		glGenQueries(1, &timerQuery);
+	}
+
+	// GL thread
+	void Destroy()
+	{
+		glDeleteQueries(1, &timerQuery);
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteRenderbuffers(1, &depthBuffer);
+		glDeleteTextures(1, &texture);
+		timerQuery = framebuffer = depthBuffer = texture = 0;
+	}
+
+	GLuint Texture() const { return texture; }
+
+	static glm::mat4 FaceProjection()
+	{
+		return glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, 100.0f);
+	}
+
+	// View matrix of a cubemap face, GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+	static glm::mat4 FaceView(const glm::vec3& position, int face)
+	{
+		static const glm::vec3 directions[6] = {
+			glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+			glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+		};
+		static const glm::vec3 ups[6] = {
+			glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+			glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+		};
+		return glm::lookAt(position, position + directions[face], ups[face]);
+	}
+
+	// Main thread: the next faces of probe to refresh this frame, as layers
+	void Schedule(int probe, std::vector<GLint>& layers)
+	{
+		layers.clear();
+		float faceMilliseconds = std::max(faceCost.load(std::memory_order_relaxed), 0.01f);
+		int count = std::min(std::max(int(BUDGET_MILLISECONDS / faceMilliseconds), 1), 6);
+		for(int i = 0; i < count; ++i)
+		{
+			layers.push_back(probe * 6 + nextFace[probe]);
+			nextFace[probe] = (nextFace[probe] + 1) % 6;
+			facesRendered[probe] = std::min(facesRendered[probe] + 1, 6);
+		}
+	}
+
+	// Main thread: whether every face of probe has been scheduled at least once
+	bool Ready(int probe) const { return facesRendered[probe] == 6; }
+
+	// GL thread: starts the frame's probe updates
+	void BeginUpdate()
+	{
+		collectTiming();
+		timing = !queryPending;
+		if(timing)
+			glBeginQuery(GL_TIME_ELAPSED, timerQuery);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, SIZE, SIZE);
+		faceCount = 0;
+	}
+
+	// GL thread: binds a face for rendering and clears it
+	void BeginFace(GLint layer)
+	{
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, layer);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		faceCount++;
+	}
+
+	// GL thread: rebuilds the mips used for rough reflections
+	void EndUpdate()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, texture);
+		glGenerateMipmap(GL_TEXTURE_CUBE_MAP_ARRAY);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+		if(timing)
+		{
+			glEndQuery(GL_TIME_ELAPSED);
+			queryPending = true;
+			queryFaces = faceCount;
+		}
+	}
+
+private:
+	GLuint texture = 0;
+	GLuint depthBuffer = 0;
+	GLuint framebuffer = 0;
+
+	// render thread timing, read by the main thread's scheduler
+	GLuint timerQuery = 0;
+	bool timing = false;
+	bool queryPending = false;
+	int faceCount = 0;
+	int queryFaces = 0;
+	std::atomic<float> faceCost{ 0.0f };
+
+	// main thread scheduling state
+	int nextFace[PROBE_COUNT] = {};
+	int facesRendered[PROBE_COUNT] = {};
+
+	// reads the last query without stalling, averaged over a few updates
+	void collectTiming()
+	{
+		if(!queryPending)
+			return;
+		GLint available = 0;
+		glGetQueryObjectiv(timerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if(!available)
+			return;
+
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(timerQuery, GL_QUERY_RESULT, &nanoseconds);
+		queryPending = false;
+
+		float cost = nanoseconds / 1000000.0f / std::max(queryFaces, 1);
+		float previous = faceCost.load(std::memory_order_relaxed);
+		faceCost.store(previous == 0.0f ? cost : previous * 0.9f + cost * 0.1f, std::memory_order_relaxed);
+	}
+};
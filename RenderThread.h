@@ -0,0 +1,205 @@
+#pragma once
+// GLAD has to be included before GLFW
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "GpuCulling.h"
+
+// One recorded draw call. The main thread fills these in while updating the scene,
+// the render thread turns them into glDrawElements calls.
+struct DrawItem
+{
+	GLuint vao;
+	GLuint ebo;					// 0 if the VAO already has its element buffer bound
+	GLsizei indexCount;
+	glm::mat4 model;
+	GLfloat roughness;		// 0 = mirror, 1 = fully rough reflections
+	// material textures as TextureCache locations (array << 16 | layer), -1 where there are none
+	GLint diffuseMap = -1, specularMap = -1, normalMap = -1;
+	GLuint firstIndex = 0;		// into the element buffer, where the mesh's level of detail starts
+	// the parts of it left after meshlet culling, in FrameCommands::drawRanges; -1 draws all of it
+	GLint firstRange = -1;
+	GLsizei rangeCount = 0;
+};
+
+// A run of visible meshlets of a draw, merged where they are contiguous
+struct DrawRange
+{
+	GLuint firstIndex;
+	GLsizei indexCount;
+};
+
+// One reflection probe face to re-render, already culled
+struct ProbeFaceCommands
+{
+	GLint layer;
+	glm::mat4 viewMatrix, projectionMatrix;
+	glm::vec3 position;
+	std::vector<DrawItem> draws;
+};
+
+// Everything the render thread needs to draw one frame.
+// Recorded by the main thread, consumed by the render thread a frame later.
+struct FrameCommands
+{
+	GLint viewportWidth, viewportHeight;
+	GLint renderWidth, renderHeight;	// of the main pass, the viewport at the dynamic resolution scale
+	int antiAliasing;		// AntiAliasing::Mode
+	// the camera without TAA's jitter, this frame's and the last one's, for reprojecting the history
+	glm::mat4 unjitteredViewProjection, previousViewProjection;
+
+	// camera
+	glm::mat4 viewMatrix, projectionMatrix;
+	glm::vec3 viewPosition;
+
+	// directional light
+	glm::vec3 directionalLightDirection;
+	glm::vec3 directionalLightDiffuse;
+	glm::vec3 directionalLightSpecular;
+	glm::mat4 lightProjection, lightView;
+
+	bool reflective;
+
+	// ambient light: the skybox's SH coefficients with the day/night tint applied,
+	// padded to vec4 for the std140 uniform block
+	glm::vec4 ambientIrradiance[9];
+
+	// skybox
+	glm::vec3 skyboxColor;
+	glm::mat4 skyboxMatrix;
+
+	// reflection probe reflective objects sample, -1 for none
+	GLint reflectionProbe;
+	glm::vec3 probePosition;
+	glm::vec3 probeBoxMin, probeBoxMax;
+	bool probeParallax;
+	// drawn before the main pass
+	std::vector<ProbeFaceCommands> probeFaces;
+
+	// already culled and sorted
+	std::vector<DrawItem> shadowDraws;
+	std::vector<DrawItem> mainDraws;
+	std::vector<DrawRange> drawRanges;
+
+	// when set, the shadow and main pass draw the objects GpuCulling culls instead
+	bool gpuCulling;
+	std::vector<GpuCulling::Object> gpuObjects;
+	std::vector<GpuCulling::Geometry> gpuGeometries;
+	std::vector<GpuCulling::Batch> gpuBatches;
+	GpuCulling::View gpuView;
+};
+
+// Owns the GL context of the window and submits frames on its own thread.
+// Two FrameCommands slots are used so the main thread can record frame N+1
+// while the render thread is still submitting frame N.
+class RenderThread
+{
+public:
+	RenderThread(GLFWwindow* window, std::function<void(const FrameCommands&)> renderFrame)
+		: window(window), renderFrame(renderFrame)
+	{
+		slotState[0] = slotState[1] = SLOT_FREE;
+
+		// hand the context over to the render thread
+		glfwMakeContextCurrent(nullptr);
+		thread = std::thread(&RenderThread::run, this);
+	}
+
+	~RenderThread()
+	{
+		Stop();
+	}
+
+	// Waits until the next slot is no longer being drawn and returns it for recording.
+	FrameCommands& BeginFrame()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		slotChanged.wait(lock, [this] { return slotState[writeIndex] == SLOT_FREE; });
+
+		FrameCommands& frame = slots[writeIndex];
+		frame.shadowDraws.clear();
+		frame.mainDraws.clear();
+		frame.drawRanges.clear();
+		frame.probeFaces.clear();
+		frame.gpuObjects.clear();
+		return frame;
+	}
+
+	// Hands the slot returned by BeginFrame over to the render thread.
+	void Submit()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slotState[writeIndex] = SLOT_READY;
+			writeIndex ^= 1;
+		}
+		slotChanged.notify_all();
+	}
+
+	// Finishes the frames already submitted, then gives the context back to the calling thread.
+	void Stop()
+	{
+		if(!thread.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		slotChanged.notify_all();
+		thread.join();
+
+		glfwMakeContextCurrent(window);
+	}
+
+private:
+	enum SlotState { SLOT_FREE, SLOT_READY, SLOT_DRAWING };
+
+	GLFWwindow* window;
+	std::function<void(const FrameCommands&)> renderFrame;
+	std::thread thread;
+
+	std::mutex mutex;
+	std::condition_variable slotChanged;
+	FrameCommands slots[2];
+	SlotState slotState[2];
+	int writeIndex = 0;
+	int readIndex = 0;
+	bool stopping = false;
+
+	void run()
+	{
+		glfwMakeContextCurrent(window);
+
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				slotChanged.wait(lock, [this] { return slotState[readIndex] == SLOT_READY || stopping; });
+				if(slotState[readIndex] != SLOT_READY)
+					break;
+				slotState[readIndex] = SLOT_DRAWING;
+			}
+
+			renderFrame(slots[readIndex]);
+			glfwSwapBuffers(window);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slotState[readIndex] = SLOT_FREE;
+				readIndex ^= 1;
+			}
+			slotChanged.notify_all();
+		}
+
+		glfwMakeContextCurrent(nullptr);
+	}
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Transform hierarchy of the scene. Every node has a local translation, rotation and scale
+// and a cached world matrix, kept in one array per field so the update only touches what it
+// needs. A node's parent always has a lower index, nodes are only ever appended under existing
+// ones. Changing a node marks it dirty; Update() then recomputes the dirty nodes' subtrees,
+// shallowest first, so its cost follows the number of moving nodes rather than the scene size.
+class SceneGraph
+{
+public:
+	typedef uint32_t NodeId;
+	static const NodeId NONE = 0xFFFFFFFF;
+
+	// A node of an imported file's hierarchy, the index is the node's within the file.
+	// Travels with the meshes until the main thread adds it to the graph.
+	struct ImportedNode
+	{
+		int index;
+		glm::vec3 translation;
+		glm::quat rotation;
+		glm::vec3 scale;
+	};
+
+	NodeId Add(NodeId parent, const glm::vec3& translation = glm::vec3(0.0f), const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+		const glm::vec3& scale = glm::vec3(1.0f))
+	{
+		NodeId node = NodeId(parents.size());
+		parents.push_back(parent);
+		firstChildren.push_back(NONE);
+		nextSiblings.push_back(NONE);
+		depths.push_back(parent == NONE ? 0 : depths[parent] + 1);
+		translations.push_back(translation);
+		rotations.push_back(rotation);
+		scales.push_back(scale);
+		worlds.push_back(glm::mat4(1.0f));
+		dirty.push_back(0);
+		if(parent != NONE)
+		{
+			nextSiblings[node] = firstChildren[parent];
+			firstChildren[parent] = node;
+		}
+		markDirty(node);
+		return node;
+	}
+
+	void SetTranslation(NodeId node, const glm::vec3& translation)
+	{
+		translations[node] = translation;
+		markDirty(node);
+	}
+	void SetRotation(NodeId node, const glm::quat& rotation)
+	{
+		rotations[node] = rotation;
+		markDirty(node);
+	}
+	void SetScale(NodeId node, const glm::vec3& scale)
+	{
+		scales[node] = scale;
+		markDirty(node);
+	}
+
+	// As of the last Update()
+	const glm::mat4& World(NodeId node) const { return worlds[node]; }
+	size_t Size() const { return parents.size(); }
+
+	// Recomputes the world matrices below every node changed since the last call.
+	// Returns how many nodes were recomputed.
+	size_t Update()
+	{
+		// a dirty node's subtree covers any dirty descendants, so parents go first
+		std::sort(dirtyNodes.begin(), dirtyNodes.end(), [this](NodeId a, NodeId b) { return depths[a] < depths[b]; });
+		size_t updated = 0;
+		for(NodeId root : dirtyNodes)
+		{
+			if(!dirty[root])
+				continue;
+			stack.assign(1, root);
+			while(!stack.empty())
+			{
+				NodeId node = stack.back();
+				stack.pop_back();
+				glm::mat4 local = glm::translate(glm::mat4(1.0f), translations[node]) * glm::mat4_cast(rotations[node]);
+				local = glm::scale(local, scales[node]);
+				worlds[node] = parents[node] == NONE ? local : worlds[parents[node]] * local;
+				dirty[node] = 0;
+				updated++;
+				for(NodeId child = firstChildren[node]; child != NONE; child = nextSiblings[child])
+					stack.push_back(child);
+			}
+		}
+		dirtyNodes.clear();
+		return updated;
+	}
+
+private:
+	std::vector<NodeId> parents, firstChildren, nextSiblings;
+	std::vector<uint32_t> depths;
+	std::vector<glm::vec3> translations;
+	std::vector<glm::quat> rotations;
+	std::vector<glm::vec3> scales;
+	std::vector<glm::mat4> worlds;
+	std::vector<uint8_t> dirty;
+	std::vector<NodeId> dirtyNodes;		// changed since the last update, in no particular order
+	std::vector<NodeId> stack;
+
+	void markDirty(NodeId node)
+	{
+		if(dirty[node])
+			return;
+		dirty[node] = 1;
+		dirtyNodes.push_back(node);
+	}
+};
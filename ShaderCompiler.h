@@ -0,0 +1,343 @@
+#pragma once
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ProgramCache.h"
+
+// Compiles and links programs without stalling the thread that draws with them.
+// With GL_KHR_parallel_shader_compile the driver compiles on its own threads and Poll()
+// checks GL_COMPLETION_STATUS_KHR without blocking. Otherwise a worker thread compiles on
+// a hidden context shared with the window's. If that cannot be created either, Request()
+// compiles right away like before. Program() is 0 until a program is ready, so callers
+// draw with a fallback (or skip the pass) meanwhile.
+// Reload() recompiles a program the same way and swaps it in between frames.
+class ShaderCompiler
+{
+public:
+	typedef size_t Handle;
+	// called once on the GL thread when a program becomes ready, with the program in use
+	typedef std::function<void(GLuint)> Setup;
+
+	// Main thread, with the window's context current
+	void Start(GLFWwindow* window, ProgramCache& cache)
+	{
+		this->cache = &cache;
+		if(GLAD_GL_KHR_parallel_shader_compile)
+		{
+			// let the driver use as many threads as it likes
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+			mode = MODE_PARALLEL;
+			return;
+		}
+
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		sharedWindow = glfwCreateWindow(1, 1, "", nullptr, window);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		if(sharedWindow == nullptr)
+			return;
+		mode = MODE_WORKER;
+		running = true;
+		worker = std::thread(&ShaderCompiler::workerLoop, this);
+	}
+
+	// Main thread with the context back, deletes every program
+	void Stop()
+	{
+		if(worker.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				running = false;
+			}
+			queueChanged.notify_all();
+			worker.join();
+		}
+		if(sharedWindow)
+			glfwDestroyWindow(sharedWindow);
+		sharedWindow = nullptr;
+
+		for(const auto& list : { &entries, &reloads })
+		{
+			for(const auto& entry : *list)
+			{
+				if(entry->program)
+					glDeleteProgram(entry->program);
+			}
+		}
+		entries.clear();
+		reloads.clear();
+		pending.clear();
+	}
+
+	// GL thread. Queues a program built from two shader sources.
+	Handle Request(const std::string& vertexSource, const std::string& fragmentSource, Setup setup = nullptr)
+	{
+		entries.emplace_back(new Entry);
+		Entry& entry = *entries.back();
+		entry.setup = setup;
+		submit(entry, vertexSource, fragmentSource);
+		return entries.size() - 1;
+	}
+
+	// GL thread. Compiles new sources for a program and swaps them in once they link; if they
+	// do not, the previous program stays. Refused (false) while the program is still compiling.
+	bool Reload(Handle handle, const std::string& vertexSource, const std::string& fragmentSource)
+	{
+		Entry& target = *entries[handle];
+		int state = target.state.load(std::memory_order_relaxed);
+		if(state != STATE_READY && state != STATE_FAILED)
+			return false;
+
+		reloads.emplace_back(new Entry);
+		Entry& entry = *reloads.back();
+		entry.setup = target.setup;
+		entry.replaces = &target;
+		submit(entry, vertexSource, fragmentSource);
+		return true;
+	}
+
+	// GL thread, once per frame. Picks up the programs that finished.
+	void Poll()
+	{
+		for(size_t i = 0; i < pending.size();)
+		{
+			Entry& entry = *pending[i];
+			int state = entry.state.load(std::memory_order_acquire);
+			if(state == STATE_COMPILING && mode == MODE_PARALLEL)
+			{
+				GLint completed = GL_FALSE;
+				glGetProgramiv(entry.program, GL_COMPLETION_STATUS_KHR, &completed);
+				if(completed)
+				{
+					state = finish(entry);
+					entry.state.store(state, std::memory_order_relaxed);
+				}
+			}
+
+			if(state == STATE_LINKED)
+			{
+				if(entry.setup)
+				{
+					glUseProgram(entry.program);
+					entry.setup(entry.program);
+				}
+
+				// a reload only replaces a running program if it can also run with the current state
+				if(entry.replaces && !validate(entry.program))
+					state = STATE_FAILED;
+				else
+				{
+					entry.state.store(STATE_READY, std::memory_order_relaxed);
+					// nothing is drawing between frames, so this swap is all or nothing
+					if(entry.replaces)
+					{
+						if(entry.replaces->program)
+							glDeleteProgram(entry.replaces->program);
+						entry.replaces->program = entry.program;
+						entry.replaces->state.store(STATE_READY, std::memory_order_relaxed);
+						entry.program = 0;
+					}
+				}
+			}
+			if(state == STATE_FAILED && entry.replaces)
+			{
+				std::cerr << "keeping the previous program" << std::endl;
+				glDeleteProgram(entry.program);
+				entry.program = 0;
+			}
+
+			if(state == STATE_LINKED || state == STATE_FAILED)
+			{
+				pending[i] = pending.back();
+				pending.pop_back();
+				// the worker is done with it too, so a finished reload can go
+				if(entry.replaces)
+					retire(&entry);
+			} else
+				i++;
+		}
+	}
+
+	// GL thread. 0 while the program is compiling or if it failed to link.
+	GLuint Program(Handle handle) const
+	{
+		const Entry& entry = *entries[handle];
+		return entry.state.load(std::memory_order_relaxed) == STATE_READY ? entry.program : 0;
+	}
+
+private:
+	enum { MODE_SYNC, MODE_PARALLEL, MODE_WORKER };
+	enum { STATE_QUEUED, STATE_COMPILING, STATE_LINKED, STATE_READY, STATE_FAILED };
+
+	struct Entry
+	{
+		std::string vertexSource, fragmentSource;
+		Setup setup;
+		uint64_t cacheKey = 0;
+		GLuint program = 0;
+		GLuint shaders[2] = {};
+		std::atomic<int> state{ STATE_QUEUED };
+		Entry* replaces = nullptr;	// for reloads, the entry that gets the program once it links
+	};
+
+	ProgramCache* cache = nullptr;
+	int mode = MODE_SYNC;
+
+	// GL thread only, the worker just sees the entries it is handed
+	std::vector<std::unique_ptr<Entry>> entries;
+	std::vector<std::unique_ptr<Entry>> reloads;
+	std::vector<Entry*> pending;
+
+	GLFWwindow* sharedWindow = nullptr;
+	std::thread worker;
+	std::mutex queueMutex;
+	std::condition_variable queueChanged;
+	std::deque<Entry*> queue;
+	bool running = false;
+
+	void submit(Entry& entry, const std::string& vertexSource, const std::string& fragmentSource)
+	{
+		entry.vertexSource = vertexSource;
+		entry.fragmentSource = fragmentSource;
+		entry.cacheKey = cache->Key({ vertexSource, fragmentSource });
+		pending.push_back(&entry);
+
+		if(mode == MODE_WORKER)
+		{
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				queue.push_back(&entry);
+			}
+			queueChanged.notify_one();
+		} else
+		{
+			int state = begin(entry);
+			if(mode == MODE_SYNC && state == STATE_COMPILING)
+				state = finish(entry);
+			entry.state.store(state, std::memory_order_release);
+		}
+		Poll();
+	}
+
+	void retire(const Entry* reload)
+	{
+		reloads.erase(std::find_if(reloads.begin(), reloads.end(), [reload](const std::unique_ptr<Entry>& entry) { return entry.get() == reload; }));
+	}
+
+	static bool validate(GLuint program)
+	{
+		glValidateProgram(program);
+		GLint validateStatus;
+		glGetProgramiv(program, GL_VALIDATE_STATUS, &validateStatus);
+		if(validateStatus == GL_TRUE)
+			return true;
+		char infoLog[512];
+		GLsizei infoLogLen = sizeof(infoLog);
+		glGetProgramInfoLog(program, infoLogLen, &infoLogLen, infoLog);
+		std::cerr << "program validation error: " << infoLog << std::endl;
+		return false;
+	}
+
+	static GLuint compileShader(GLenum type, const std::string& source)
+	{
+		GLuint shader = glCreateShader(type);
+		const char* sourceCString = source.c_str();
+		glShaderSource(shader, 1, &sourceCString, nullptr);
+		glCompileShader(shader);
+		return shader;
+	}
+
+	static void printShaderLog(GLuint shader)
+	{
+		GLint compileStatus;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &compileStatus);
+		if(compileStatus == GL_TRUE)
+			return;
+		char infoLog[512];
+		GLsizei infoLogLen = sizeof(infoLog);
+		glGetShaderInfoLog(shader, infoLogLen, &infoLogLen, infoLog);
+		std::cerr << "shader compile error: " << infoLog << std::endl;
+	}
+
+	// Restores the program from the cache or starts compiling and linking it.
+	// Nothing here waits on the compiler, the status is only queried in finish().
+	int begin(Entry& entry)
+	{
+		entry.program = cache->Load(entry.cacheKey);
+		if(entry.program)
+			return STATE_LINKED;
+
+		entry.shaders[0] = compileShader(GL_VERTEX_SHADER, entry.vertexSource);
+		entry.shaders[1] = compileShader(GL_FRAGMENT_SHADER, entry.fragmentSource);
+		entry.program = glCreateProgram();
+		glAttachShader(entry.program, entry.shaders[0]);
+		glAttachShader(entry.program, entry.shaders[1]);
+		cache->PrepareForStore(entry.program);
+		glLinkProgram(entry.program);
+		return STATE_COMPILING;
+	}
+
+	// Checks the link, stores the binary and frees the shaders
+	int finish(Entry& entry)
+	{
+		GLint linkStatus;
+		glGetProgramiv(entry.program, GL_LINK_STATUS, &linkStatus);
+		if(linkStatus != GL_TRUE)
+		{
+			printShaderLog(entry.shaders[0]);
+			printShaderLog(entry.shaders[1]);
+			char infoLog[512];
+			GLsizei infoLogLen = sizeof(infoLog);
+			glGetProgramInfoLog(entry.program, infoLogLen, &infoLogLen, infoLog);
+			std::cerr << "program link error: " << infoLog << std::endl;
+		} else
+			cache->Store(entry.cacheKey, entry.program);
+
+		for(GLuint shader : entry.shaders)
+		{
+			glDetachShader(entry.program, shader);
+			glDeleteShader(shader);
+		}
+		entry.vertexSource.clear();
+		entry.fragmentSource.clear();
+		return linkStatus == GL_TRUE ? STATE_LINKED : STATE_FAILED;
+	}
+
+	// Compiles on the shared context. glFinish() makes sure the program is complete
+	// before the render thread's context is allowed to use it.
+	void workerLoop()
+	{
+		glfwMakeContextCurrent(sharedWindow);
+		while(true)
+		{
+			Entry* entry;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueChanged.wait(lock, [this] { return !running || !queue.empty(); });
+				if(!running)
+					break;
+				entry = queue.front();
+				queue.pop_front();
+			}
+
+			int state = begin(*entry);
+			if(state == STATE_COMPILING)
+				state = finish(*entry);
+			glFinish();
+			entry->state.store(state, std::memory_order_release);
+		}
+		glfwMakeContextCurrent(nullptr);
+	}
+};
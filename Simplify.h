@@ -0,0 +1,197 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Triangle mesh simplification by edge collapse with quadric error metrics (Garland and
+// Heckbert). A vertex only ever collapses onto one of its neighbours, so every level of
+// detail indexes the same vertex buffer. Vertices on a border are locked, and that includes
+// attribute seams: UV or normal seams store a position twice, which makes their edges
+// borders once identical vertices are merged. Seams therefore never open up.
+namespace simplify
+{
+	// Symmetric 4x4 matrix summing the squared distances to planes, weighted by area
+	struct Quadric
+	{
+		double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+		double weight;
+	};
+
+	inline Quadric PlaneQuadric(const glm::vec3& normal, float distance, double weight)
+	{
+		double a = normal.x, b = normal.y, c = normal.z, d = distance;
+		return { a * a * weight, a * b * weight, a * c * weight, a * d * weight, b * b * weight, b * c * weight, b * d * weight,
+			c * c * weight, c * d * weight, d * d * weight, weight };
+	}
+
+	inline void Add(Quadric& q, const Quadric& other)
+	{
+		q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02; q.a03 += other.a03;
+		q.a11 += other.a11; q.a12 += other.a12; q.a13 += other.a13;
+		q.a22 += other.a22; q.a23 += other.a23; q.a33 += other.a33;
+		q.weight += other.weight;
+	}
+
+	// Mean squared distance of p to the quadric's planes
+	inline double Evaluate(const Quadric& q, const glm::vec3& p)
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double sum = q.a00 * x * x + 2.0 * q.a01 * x * y + 2.0 * q.a02 * x * z + 2.0 * q.a03 * x
+			+ q.a11 * y * y + 2.0 * q.a12 * y * z + 2.0 * q.a13 * y
+			+ q.a22 * z * z + 2.0 * q.a23 * z + q.a33;
+		return q.weight > 0.0 ? std::max(sum / q.weight, 0.0) : 0.0;
+	}
+
+	// Simplifies a triangle list to about targetIndexCount indices, stopping early rather than
+	// moving the surface further than maxError. remap[v] is the first vertex identical to v,
+	// the result uses those. error is the largest distance the surface moved, in model units.
+	inline std::vector<unsigned int> Simplify(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& remap,
+		const std::vector<unsigned int>& indices, size_t targetIndexCount, float maxError, float& error)
+	{
+		size_t vertexCount = positions.size();
+		std::vector<unsigned int> result(indices.size());
+		for(size_t i = 0; i < indices.size(); i++)
+			result[i] = remap[indices[i]];
+		error = 0.0f;
+
+		// quadrics of the starting triangles, summed up along the collapses
+		std::vector<Quadric> quadrics(vertexCount, Quadric{});
+		for(size_t i = 0; i + 2 < result.size(); i += 3)
+		{
+			const glm::vec3& p0 = positions[result[i]];
+			glm::vec3 normal = glm::cross(positions[result[i + 1]] - p0, positions[result[i + 2]] - p0);
+			float length = glm::length(normal);
+			if(length == 0.0f)
+				continue;
+			normal /= length;
+			Quadric plane = PlaneQuadric(normal, -glm::dot(normal, p0), length * 0.5);
+			for(int k = 0; k < 3; k++)
+				Add(quadrics[result[i + k]], plane);
+		}
+
+		// edges used by exactly two triangles are interior, anything else locks its vertices
+		std::vector<uint8_t> locked(vertexCount, 0);
+		std::unordered_map<uint64_t, int> edgeUses;
+		for(size_t i = 0; i + 2 < result.size(); i += 3)
+		{
+			for(int k = 0; k < 3; k++)
+			{
+				uint64_t a = result[i + k], b = result[i + (k + 1) % 3];
+				edgeUses[std::min(a, b) << 32 | std::max(a, b)]++;
+			}
+		}
+		for(const auto& edge : edgeUses)
+		{
+			if(edge.second != 2)
+				locked[edge.first >> 32] = locked[edge.first & 0xFFFFFFFF] = 1;
+		}
+
+		struct Collapse
+		{
+			unsigned int from, to;
+			double cost;
+		};
+		std::vector<Collapse> candidates;
+		std::vector<unsigned int> collapse(vertexCount), adjacencyOffsets(vertexCount + 1), adjacency;
+		std::vector<uint8_t> touched(vertexCount);
+		double maxCost = double(maxError) * maxError;
+
+		// every pass collapses a set of edges far enough apart not to affect each other
+		while(result.size() > targetIndexCount)
+		{
+			// triangles around each vertex
+			std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+			for(unsigned int index : result)
+				adjacencyOffsets[index + 1]++;
+			for(size_t v = 0; v < vertexCount; v++)
+				adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+			adjacency.resize(result.size());
+			std::vector<unsigned int> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+			for(size_t i = 0; i < result.size(); i++)
+				adjacency[fill[result[i]]++] = unsigned(i / 3);
+
+			candidates.clear();
+			for(size_t i = 0; i + 2 < result.size(); i += 3)
+			{
+				for(int k = 0; k < 3; k++)
+				{
+					unsigned int a = result[i + k], b = result[i + (k + 1) % 3];
+					for(int direction = 0; direction < 2; direction++)
+					{
+						unsigned int from = direction ? b : a, to = direction ? a : b;
+						if(locked[from])
+							continue;
+						Quadric q = quadrics[from];
+						Add(q, quadrics[to]);
+						candidates.push_back({ from, to, Evaluate(q, positions[to]) });
+					}
+				}
+			}
+			std::sort(candidates.begin(), candidates.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+			for(size_t v = 0; v < vertexCount; v++)
+				collapse[v] = unsigned(v);
+			std::fill(touched.begin(), touched.end(), 0);
+			size_t trianglesToRemove = (result.size() - targetIndexCount) / 3;
+			size_t removed = 0;
+			for(const Collapse& candidate : candidates)
+			{
+				if(removed >= trianglesToRemove || candidate.cost > maxCost)
+					break;
+				if(touched[candidate.from] || touched[candidate.to])
+					continue;
+
+				// no triangle around from may flip over
+				bool flips = false;
+				for(unsigned int t = adjacencyOffsets[candidate.from]; t < adjacencyOffsets[candidate.from + 1] && !flips; t++)
+				{
+					const unsigned int* triangle = &result[adjacency[t] * 3];
+					if(triangle[0] == candidate.to || triangle[1] == candidate.to || triangle[2] == candidate.to)
+						continue;
+					glm::vec3 corners[3], moved[3];
+					for(int k = 0; k < 3; k++)
+					{
+						corners[k] = positions[triangle[k]];
+						moved[k] = triangle[k] == candidate.from ? positions[candidate.to] : corners[k];
+					}
+					glm::vec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+					glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+					flips = glm::dot(before, after) <= 0.0f;
+				}
+				if(flips)
+					continue;
+
+				for(unsigned int t = adjacencyOffsets[candidate.from]; t < adjacencyOffsets[candidate.from + 1]; t++)
+				{
+					const unsigned int* triangle = &result[adjacency[t] * 3];
+					if(triangle[0] == candidate.to || triangle[1] == candidate.to || triangle[2] == candidate.to)
+						removed++;
+					touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+				}
+				collapse[candidate.from] = candidate.to;
+				Add(quadrics[candidate.to], quadrics[candidate.from]);
+				error = std::max(error, float(std::sqrt(candidate.cost)));
+			}
+			if(removed == 0)
+				break;
+
+			// apply the collapses and drop the triangles that became degenerate
+			size_t kept = 0;
+			for(size_t i = 0; i + 2 < result.size(); i += 3)
+			{
+				unsigned int a = collapse[result[i]], b = collapse[result[i + 1]], c = collapse[result[i + 2]];
+				if(a == b || b == c || a == c)
+					continue;
+				result[kept++] = a;
+				result[kept++] = b;
+				result[kept++] = c;
+			}
+			result.resize(kept);
+		}
+		return result;
+	}
+}
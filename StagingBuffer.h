@@ -0,0 +1,109 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <cstring>
+
+// Persistently mapped upload buffer, split into one segment per frame in flight.
+// Data is written straight into mapped memory and copied into its destination
+// buffer on the GPU with glCopyBufferSubData. Each segment is fenced at the end of
+// its frame so it is only reused once the GPU has finished copying out of it.
+// Without GL 4.4 / ARB_buffer_storage it stays disabled and Copy() always fails.
+class StagingBuffer
+{
+public:
+	static const int SEGMENT_COUNT = 3;
+
+	// Needs the GL context
+	void Create(GLsizeiptr segmentSize)
+	{
+		if(!(GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage))
+			return;
+
+		this->segmentSize = segmentSize;
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glBufferStorage(GL_COPY_READ_BUFFER, segmentSize * SEGMENT_COUNT, nullptr, flags);
+		mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, segmentSize * SEGMENT_COUNT, flags));
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+
+	void Destroy()
+	{
+		for(GLsync& fence : fences)
+		{
+			if(fence)
+				glDeleteSync(fence);
+			fence = nullptr;
+		}
+		if(buffer)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glDeleteBuffers(1, &buffer);
+		}
+		buffer = 0;
+		mapped = nullptr;
+	}
+
+	bool Enabled() const { return mapped != nullptr; }
+	GLsizeiptr SegmentSize() const { return segmentSize; }
+
+	// Moves on to the next segment, waiting for the GPU if it is still copying out of it
+	void BeginFrame()
+	{
+		segment = (segment + 1) % SEGMENT_COUNT;
+		used = 0;
+
+		GLsync& fence = fences[segment];
+		if(fence)
+		{
+			while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
+	// Copies size bytes into destination at offset. Returns false if this frame's segment is full.
+	bool Copy(GLuint destination, GLintptr offset, const void* data, GLsizeiptr size)
+	{
+		// keep the source offsets aligned for the copy
+		GLsizeiptr alignedUsed = (used + 15) & ~GLsizeiptr(15);
+		if(!mapped || alignedUsed + size > segmentSize)
+			return false;
+
+		GLintptr sourceOffset = segment * segmentSize + alignedUsed;
+		memcpy(mapped + sourceOffset, data, size);
+
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, destination);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sourceOffset, offset, size);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+		used = alignedUsed + size;
+		return true;
+	}
+
+	bool Fits(GLsizeiptr size) const
+	{
+		return mapped && ((used + 15) & ~GLsizeiptr(15)) + size <= segmentSize;
+	}
+
+	// Fences the copies issued from the current segment
+	void EndFrame()
+	{
+		if(mapped && used > 0)
+			fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+private:
+	GLuint buffer = 0;
+	unsigned char* mapped = nullptr;
+	GLsizeiptr segmentSize = 0;
+	GLsizeiptr used = 0;
+	int segment = 0;
+	GLsync fences[SEGMENT_COUNT] = {};
+};
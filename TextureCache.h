@@ -0,0 +1,558 @@
+#pragma once
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "JobSystem.h"
+
+// Material textures shared by every model, keyed by path. Meshes hold a reference (shared_ptr)
+// and the image's layer is freed with the last one.
+// Images are packed into GL_TEXTURE_2D_ARRAYs by size and format, so draws with different
+// materials only differ in the layers they sample, not in bound textures. At most
+// MAX_ARRAYS arrays exist, bound together with BindArrays().
+// Mips are streamed: an image first only gets its mips up to INITIAL_SIZE. The main thread
+// reports how many texels across the visible meshes show it (Need()), and Update() decodes
+// the finer mips that are missing on a worker thread, moving the image to a bigger layer once
+// they are ready. Everything resident stays within BUDGET_BYTES: to make room, the images
+// needed least recently drop their finest mips again (copied on the GPU into a smaller layer).
+// Acquire() can be called from any thread, e.g. from an import job. Update() runs on the GL
+// thread. An image's location reads as -1 until its first upload, and forever if its file
+// could not be decoded.
+class TextureCache
+{
+public:
+	static const int UPLOADS_PER_FRAME = 4;
+	static const int STREAMS_IN_FLIGHT = 2;
+	static const int MAX_ARRAYS = 8;		// texture units 6-13, fragment shaders only have 16 for sure
+	static const int MAX_LAYERS = 16;
+	static const size_t ARRAY_BUDGET_BYTES = 32 << 20;	// fewer layers per array for big images
+	static const size_t BUDGET_BYTES = 256 << 20;
+	static const int INITIAL_SIZE = 64;
+	static const uint32_t STALE_FRAMES = 120;		// not needed for this long = back to the initial mips
+	static const uint32_t RETIRE_UPDATES = 3;		// frames already recorded may still sample a replaced layer
+
+	struct Image
+	{
+		std::string path;
+		// array index << 16 | layer, as main.fsh expects it, or -1
+		GLint Location() const { return location.load(std::memory_order_acquire); }
+
+	private:
+		friend class TextureCache;
+		std::atomic<GLint> location{ -1 };
+		int width = 0, height = 0;	// full size, set by the first decode
+
+		// main thread, in Need()
+		std::atomic<float> neededTexels{ 0.0f };
+		std::atomic<uint32_t> neededFrame{ 0 };
+
+		// RGBA mips from firstLevel on, from the decode job, freed after the upload
+		int firstLevel = 0;
+		std::vector<std::vector<unsigned char>> levels;
+
+		// GL thread only
+		int residentLevel = -1;
+		size_t residentBytes = 0;
+		size_t streamingBytes = 0;	// growth once the mips being decoded are uploaded
+		bool streaming = false;
+		bool undecodable = false;	// a decode failed, the image is not streamed anymore
+	};
+
+	explicit TextureCache(JobSystem& jobs)
+		: jobs(jobs)
+	{
+	}
+
+	~TextureCache()
+	{
+		jobs.Wait(decodeCounter);
+	}
+
+	// Any thread
+	std::shared_ptr<Image> Acquire(const std::string& path)
+	{
+		std::string key = std::filesystem::path(path).lexically_normal().generic_string();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = images.find(key);
+		if(found != images.end())
+		{
+			std::shared_ptr<Image> image = found->second.lock();
+			if(image)
+				return image;
+		}
+
+		std::shared_ptr<Image> image(new Image, [this](Image* image) { release(image); });
+		image->path = key;
+		images[key] = image;
+		decode(image, -1);
+		return image;
+	}
+
+	// Main thread, before the frame's Need() calls
+	void BeginFrame()
+	{
+		frame.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Main thread: the frame shows image about this many texels across
+	void Need(Image& image, float texels)
+	{
+		uint32_t now = frame.load(std::memory_order_relaxed);
+		if(image.neededFrame.load(std::memory_order_relaxed) != now || texels > image.neededTexels.load(std::memory_order_relaxed))
+			image.neededTexels.store(texels, std::memory_order_relaxed);
+		image.neededFrame.store(now, std::memory_order_relaxed);
+	}
+
+	// GL thread, once per frame
+	void Update()
+	{
+		updates++;
+
+		std::vector<std::shared_ptr<Image>> uploads;
+		std::vector<Released> released;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			size_t count = std::min(decoded.size(), size_t(UPLOADS_PER_FRAME));
+			uploads.assign(std::make_move_iterator(decoded.begin()), std::make_move_iterator(decoded.begin() + count));
+			decoded.erase(decoded.begin(), decoded.begin() + count);
+			released.swap(releasedImages);
+		}
+
+		for(const Released& image : released)
+		{
+			residentBytes -= image.bytes;
+			retire(image.location);
+		}
+		freeRetired();
+
+		for(const std::shared_ptr<Image>& image : uploads)
+		{
+			pendingBytes -= image->streamingBytes;
+			image->streamingBytes = 0;
+			image->streaming = false;
+			// a failed decode comes back without mips
+			if(image->levels.empty())
+				image->undecodable = true;
+			// skipped if no mesh holds it anymore
+			else if(image.use_count() > 1)
+				upload(*image);
+			image->levels.clear();
+			image->levels.shrink_to_fit();
+		}
+		uploads.clear();	// the last references may be dropped here, outside the lock
+
+		stream();
+	}
+
+	// GL thread: binds array i to texture unit firstUnit + i
+	void BindArrays(GLuint firstUnit) const
+	{
+		for(size_t i = 0; i < arrays.size(); i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + firstUnit + GLuint(i));
+			glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[i].texture);
+		}
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// GL thread, deletes the arrays. References still held afterwards read as -1.
+	void Destroy()
+	{
+		std::vector<std::shared_ptr<Image>> alive, pending;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			alive = aliveImages();
+			pending.swap(decoded);
+			releasedImages.clear();
+		}
+
+		for(const std::shared_ptr<Image>& image : alive)
+			image->location.store(-1, std::memory_order_relaxed);
+		for(const TextureArray& array : arrays)
+		{
+			if(array.texture)
+				glDeleteTextures(1, &array.texture);
+		}
+		arrays.clear();
+		retired.clear();
+		residentBytes = pendingBytes = 0;
+	}
+
+private:
+	JobSystem& jobs;
+	JobCounter decodeCounter;
+	std::atomic<uint32_t> frame{ 0 };
+
+	// images of one size and format, allocated up front. texture is 0 for a deleted array,
+	// whose slot (= texture unit) is reused.
+	struct TextureArray
+	{
+		GLenum format;
+		int width, height, levels, layers;
+		GLuint texture;
+		std::vector<int> freeLayers;
+	};
+
+	struct Released
+	{
+		GLint location;
+		size_t bytes;
+	};
+
+	std::mutex mutex;
+	std::map<std::string, std::weak_ptr<Image>> images;
+	std::vector<std::shared_ptr<Image>> decoded;	// waiting for Update()
+	std::vector<Released> releasedImages;		// layers given back by the next Update()
+
+	// GL thread only
+	std::vector<TextureArray> arrays;
+	std::vector<std::pair<GLint, uint32_t>> retired;	// layer, Update() it was replaced in
+	uint32_t updates = 0;
+	size_t residentBytes = 0;
+	size_t pendingBytes = 0;
+
+	// Called with the last reference, from whichever thread dropped it
+	void release(Image* image)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			// the path may already belong to a newer image
+			auto found = images.find(image->path);
+			if(found != images.end() && found->second.expired())
+				images.erase(found);
+			GLint location = image->location.load(std::memory_order_relaxed);
+			if(location != -1)
+				releasedImages.push_back({ location, image->residentBytes });
+		}
+		delete image;
+	}
+
+	// Needs the lock
+	std::vector<std::shared_ptr<Image>> aliveImages() const
+	{
+		std::vector<std::shared_ptr<Image>> alive;
+		for(const auto& pair : images)
+		{
+			std::shared_ptr<Image> image = pair.second.lock();
+			if(image)
+				alive.push_back(std::move(image));
+		}
+		return alive;
+	}
+
+	static int levelCount(int width, int height)
+	{
+		int levels = 1;
+		while((std::max(width, height) >> levels) > 0)
+			levels++;
+		return levels;
+	}
+
+	// the first mip no bigger than INITIAL_SIZE
+	static int initialLevel(int width, int height)
+	{
+		int level = 0;
+		while((std::max(width, height) >> level) > INITIAL_SIZE)
+			level++;
+		return level;
+	}
+
+	// memory of a layer holding the mips from level on
+	static size_t levelBytes(const Image& image, int level)
+	{
+		size_t width = std::max(1, image.width >> level), height = std::max(1, image.height >> level);
+		return width * height * 4 * 4 / 3;
+	}
+
+	// The finest mip the image was needed at lately
+	int wantedLevel(const Image& image) const
+	{
+		int coarsest = initialLevel(image.width, image.height);
+		float texels = image.neededTexels.load(std::memory_order_relaxed);
+		uint32_t age = frame.load(std::memory_order_relaxed) - image.neededFrame.load(std::memory_order_relaxed);
+		if(age > STALE_FRAMES || texels < 1.0f)
+			return coarsest;
+		int level = int(std::floor(std::log2(std::max(image.width, image.height) / texels)));
+		return std::min(std::max(level, 0), coarsest);
+	}
+
+	// Decodes the file on a worker thread and builds the mips from level on (-1 = the initial one)
+	void decode(std::shared_ptr<Image> image, int level)
+	{
+		// the job keeps its own reference until the image is handed to Update()
+		jobs.RunBackground([this, image, level]() mutable
+		{
+			int width, height, channels;
+			unsigned char* pixels = stbi_load(image->path.c_str(), &width, &height, &channels, 4);
+			if(!pixels)
+			{
+				std::cerr << "ERROR loading texture " << image->path << "\n";
+				// still handed to Update(), which undoes the streaming bookkeeping on the GL thread
+				std::lock_guard<std::mutex> lock(mutex);
+				decoded.push_back(std::move(image));
+				return;
+			}
+			if(level == -1)
+			{
+				image->width = width;
+				image->height = height;
+				level = initialLevel(width, height);
+			}
+
+			std::vector<unsigned char> current(pixels, pixels + size_t(width) * height * 4);
+			stbi_image_free(pixels);
+			image->firstLevel = level;
+			for(int i = 0; ; i++)
+			{
+				if(i >= level)
+					image->levels.push_back(current);
+				if(width == 1 && height == 1)
+					break;
+				current = downsample(current, width, height);
+				width = std::max(1, width / 2);
+				height = std::max(1, height / 2);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			decoded.push_back(std::move(image));
+		}, &decodeCounter);
+	}
+
+	// Box filters an RGBA image to half its size (rounded down, at least 1)
+	static std::vector<unsigned char> downsample(const std::vector<unsigned char>& source, int width, int height)
+	{
+		int halfWidth = std::max(1, width / 2), halfHeight = std::max(1, height / 2);
+		std::vector<unsigned char> result(size_t(halfWidth) * halfHeight * 4);
+		for(int y = 0; y < halfHeight; y++)
+		{
+			int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for(int x = 0; x < halfWidth; x++)
+			{
+				int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+				for(int c = 0; c < 4; c++)
+				{
+					int sum = source[(size_t(y0) * width + x0) * 4 + c] + source[(size_t(y0) * width + x1) * 4 + c]
+						+ source[(size_t(y1) * width + x0) * 4 + c] + source[(size_t(y1) * width + x1) * 4 + c];
+					result[(size_t(y) * halfWidth + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		return result;
+	}
+
+	// A free layer for an image of this size, in a new array if needed. -1 once MAX_ARRAYS are used up.
+	GLint allocateLayer(GLenum format, int width, int height, int levels)
+	{
+		size_t freeSlot = arrays.size();
+		for(size_t i = 0; i < arrays.size(); i++)
+		{
+			TextureArray& array = arrays[i];
+			if(array.texture == 0)
+				freeSlot = std::min(freeSlot, i);
+			if(array.texture == 0 || array.format != format || array.width != width || array.height != height || array.freeLayers.empty())
+				continue;
+			int layer = array.freeLayers.back();
+			array.freeLayers.pop_back();
+			return GLint(i) << 16 | layer;
+		}
+		if(freeSlot == MAX_ARRAYS)
+			return -1;
+
+		size_t imageBytes = size_t(width) * height * 4 * 4 / 3;
+		int layers = int(std::min(std::max(ARRAY_BUDGET_BYTES / imageBytes, size_t(1)), size_t(MAX_LAYERS)));
+
+		TextureArray array = { format, width, height, levels, layers, 0, {} };
+		glGenTextures(1, &array.texture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+		if(GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage)
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, format, width, height, layers);
+		else
+		{
+			for(int level = 0; level < levels; ++level)
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, std::max(1, width >> level), std::max(1, height >> level), layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+		for(int layer = layers - 1; layer > 0; layer--)
+			array.freeLayers.push_back(layer);
+		if(freeSlot == arrays.size())
+			arrays.push_back(array);
+		else
+			arrays[freeSlot] = array;
+		return GLint(freeSlot) << 16;
+	}
+
+	void retire(GLint location)
+	{
+		retired.push_back({ location, updates });
+	}
+
+	// Frees the layers no recorded frame can sample anymore. Arrays left empty are deleted,
+	// so dropped mips really give their memory back.
+	void freeRetired()
+	{
+		size_t kept = 0;
+		for(const auto& entry : retired)
+		{
+			if(updates - entry.second < RETIRE_UPDATES)
+			{
+				retired[kept++] = entry;
+				continue;
+			}
+			TextureArray& array = arrays[entry.first >> 16];
+			array.freeLayers.push_back(entry.first & 0xFFFF);
+			if(int(array.freeLayers.size()) == array.layers)
+			{
+				glDeleteTextures(1, &array.texture);
+				array.texture = 0;
+				array.freeLayers.clear();
+			}
+		}
+		retired.resize(kept);
+	}
+
+	// Points the image at a new layer holding its mips from level on
+	void moveTo(Image& image, GLint location, int level)
+	{
+		GLint previous = image.location.load(std::memory_order_relaxed);
+		if(previous != -1)
+			retire(previous);
+		residentBytes -= image.residentBytes;
+		image.residentBytes = levelBytes(image, level);
+		image.residentLevel = level;
+		residentBytes += image.residentBytes;
+		image.location.store(location, std::memory_order_release);
+	}
+
+	void upload(Image& image)
+	{
+		// mips it already has
+		if(image.residentLevel != -1 && image.firstLevel >= image.residentLevel)
+			return;
+
+		// out of arrays, a coarser mip whose array still has room beats no texture at all
+		int lastLevel = image.residentLevel != -1 ? image.residentLevel : image.firstLevel + int(image.levels.size());
+		for(int level = image.firstLevel; level < lastLevel; level++)
+		{
+			int width = std::max(1, image.width >> level), height = std::max(1, image.height >> level);
+			int levels = levelCount(width, height);
+			GLint location = allocateLayer(GL_RGBA8, width, height, levels);
+			if(location == -1)
+				continue;
+			if(level != image.firstLevel)
+				std::cerr << "WARNING no texture array left for " << image.path << ", uploaded at " << width << "x" << height << "\n";
+
+			glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[location >> 16].texture);
+			for(int i = 0; i < levels; i++)
+			{
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, location & 0xFFFF, std::max(1, width >> i), std::max(1, height >> i), 1,
+					GL_RGBA, GL_UNSIGNED_BYTE, image.levels[level - image.firstLevel + i].data());
+			}
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+			moveTo(image, location, level);
+			return;
+		}
+		if(image.residentLevel == -1)
+			std::cerr << "ERROR no texture array left for " << image.path << "\n";
+	}
+
+	// Drops the mips finer than level, copying the others into a smaller layer (GL 4.3 / ARB_copy_image)
+	void evict(Image& image, int level)
+	{
+		GLint previous = image.location.load(std::memory_order_relaxed);
+		int width = std::max(1, image.width >> level), height = std::max(1, image.height >> level);
+		int levels = levelCount(width, height);
+		GLint location = allocateLayer(GL_RGBA8, width, height, levels);
+		if(location == -1)
+			return;
+
+		for(int i = 0; i < levels; i++)
+		{
+			glCopyImageSubData(arrays[previous >> 16].texture, GL_TEXTURE_2D_ARRAY, level - image.residentLevel + i, 0, 0, previous & 0xFFFF,
+				arrays[location >> 16].texture, GL_TEXTURE_2D_ARRAY, i, 0, 0, location & 0xFFFF,
+				std::max(1, width >> i), std::max(1, height >> i), 1);
+		}
+		moveTo(image, location, level);
+	}
+
+	// Starts decoding the finer mips images need, most missing detail first
+	void stream()
+	{
+		std::vector<std::shared_ptr<Image>> alive;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			alive = aliveImages();
+		}
+
+		int inFlight = 0;
+		std::vector<std::shared_ptr<Image>> wanting;
+		std::vector<Image*> resident;
+		for(const std::shared_ptr<Image>& image : alive)
+		{
+			if(image->streaming)
+				inFlight++;
+			else if(image->residentLevel != -1)
+			{
+				resident.push_back(image.get());
+				if(!image->undecodable && wantedLevel(*image) < image->residentLevel)
+					wanting.push_back(image);
+			}
+		}
+		if(wanting.empty() || inFlight >= STREAMS_IN_FLIGHT)
+			return;
+
+		std::sort(wanting.begin(), wanting.end(), [this](const std::shared_ptr<Image>& a, const std::shared_ptr<Image>& b)
+		{
+			return a->residentLevel - wantedLevel(*a) > b->residentLevel - wantedLevel(*b);
+		});
+		// least recently needed first
+		std::sort(resident.begin(), resident.end(), [](const Image* a, const Image* b)
+		{
+			return a->neededFrame.load(std::memory_order_relaxed) < b->neededFrame.load(std::memory_order_relaxed);
+		});
+
+		bool canEvict = GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_copy_image;
+		size_t victim = 0;
+		for(size_t i = 0; i < wanting.size() && inFlight < STREAMS_IN_FLIGHT; i++)
+		{
+			Image& image = *wanting[i];
+			int level = wantedLevel(image);
+			size_t growth = levelBytes(image, level) - image.residentBytes;
+
+			// images showing more detail than they currently need make room
+			for(; canEvict && residentBytes + pendingBytes + growth > BUDGET_BYTES && victim < resident.size(); victim++)
+			{
+				Image& other = *resident[victim];
+				int otherLevel = wantedLevel(other);
+				if(&other != &image && otherLevel > other.residentLevel)
+					evict(other, otherLevel);
+			}
+			if(residentBytes + pendingBytes + growth > BUDGET_BYTES)
+				break;
+
+			image.streaming = true;
+			image.streamingBytes = growth;
+			pendingBytes += growth;
+			inFlight++;
+			decode(wanting[i], level);
+		}
+	}
+};
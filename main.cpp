@@ -7,28 +7,235 @@
 #include <assimp/Importer.hpp>
 
 #define _USE_MATH_DEFINES
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "AntiAliasing.h"
+#include "Atmosphere.h"
+#include "CompressedCubemap.h"
+#include "Culling.h"
+#include "DynamicResolution.h"
+#include "EnvironmentMap.h"
+#include "GpuCulling.h"
+#include "JobSystem.h"
+#include "LockFreeQueue.h"
+#include "Meshlets.h"
+#include "ObjLoader.h"
+#include "ProgramCache.h"
+#include "ReflectionProbes.h"
+#include "SceneGraph.h"
+#include "RenderThread.h"
+#include "ShaderCompiler.h"
+#include "Simplify.h"
+#include "StagingBuffer.h"
+#include "TextureCache.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 using namespace std;
 
-GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath);
+// defines are inserted after the #version line of both shaders
+GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath, const std::string& defines = "");
+// same, compiled in the background by compiler; the program is 0 until it is ready
+ShaderCompiler::Handle RequestShaderProgram(ShaderCompiler& compiler, const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath,
+	const std::string& defines = "", ShaderCompiler::Setup setup = nullptr);
 GLuint CreateShaderFromFile(const GLuint& shaderType, const std::string& shaderFilePath);
 GLuint CreateShaderFromSource(const GLuint& shaderType, const std::string& shaderSource);
+std::string ReadShaderFile(const std::string& shaderFilePath);
+std::string InjectDefines(const std::string& shaderSource, const std::string& defines);
+
+// main.vsh and depth.vsh read their objects from GpuCulling's buffer with this
+const std::string GPU_DRIVEN_DEFINE = "#define GPU_DRIVEN\n";
+
+// Compile-time features of main.vsh/main.fsh. Each combination is a separate program,
+// so the shader has no branches or loops depending on them left at runtime.
+struct ShaderFeatures
+{
+	enum ShadowFilter { SHADOW_HARD, SHADOW_PCF };
+
+	bool reflection = false;
+	int directionalLights = 1;
+	int pointLights = 0;
+	int spotLights = 0;
+	ShadowFilter shadowFilter = SHADOW_PCF;
+	bool gpuDriven = false;		// objects come from GpuCulling instead of uniforms
+
+	uint32_t Key() const
+	{
+		return uint32_t(reflection) | (directionalLights & 0xF) << 1 | (pointLights & 0xF) << 5
+			| (spotLights & 0xF) << 9 | uint32_t(shadowFilter) << 13 | uint32_t(gpuDriven) << 14;
+	}
+
+	std::string Defines() const
+	{
+		return "#define REFLECTION " + std::to_string(reflection ? 1 : 0) + "\n"
+			+ "#define DIRECTIONAL_LIGHT_COUNT " + std::to_string(directionalLights) + "\n"
+			+ "#define POINT_LIGHT_COUNT " + std::to_string(pointLights) + "\n"
+			+ "#define SPOT_LIGHT_COUNT " + std::to_string(spotLights) + "\n"
+			+ "#define SHADOW_FILTER " + std::to_string(int(shadowFilter)) + "\n"
+			+ (gpuDriven ? GPU_DRIVEN_DEFINE : "");
+	}
+};
+
+// The programs built from one pair of shader files, one per feature set.
+// A variant is requested from the compiler the first time it is asked for, which owns it from then on.
+class ShaderPermutations
+{
+public:
+	// setup is called on every new program while it is in use, for the uniforms that never change
+	ShaderPermutations(ShaderCompiler& compiler, const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath, ShaderCompiler::Setup setup)
+		: compiler(compiler), vertexShaderFilePath(vertexShaderFilePath), fragmentShaderFilePath(fragmentShaderFilePath), setup(setup)
+	{
+	}
+
+	// Needs the GL context. 0 until the variant has finished compiling.
+	GLuint Get(const ShaderFeatures& features)
+	{
+		auto found = programs.find(features.Key());
+		if(found == programs.end())
+			found = programs.emplace(features.Key(), RequestShaderProgram(compiler, vertexShaderFilePath, fragmentShaderFilePath, features.Defines(), setup)).first;
+		return compiler.Program(found->second);
+	}
+
+private:
+	ShaderCompiler& compiler;
+	std::string vertexShaderFilePath, fragmentShaderFilePath;
+	ShaderCompiler::Setup setup;
+	std::map<uint32_t, ShaderCompiler::Handle> programs;
+};
+
+// The shader files behind the background compiled programs. Update() checks them about
+// twice a second and reloads the programs whose files changed, so shaders can be edited while running.
+class ShaderWatcher
+{
+public:
+	void Watch(ShaderCompiler::Handle handle, const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath, const std::string& defines)
+	{
+		programs.push_back({ handle, vertexShaderFilePath, fragmentShaderFilePath, defines,
+			lastWriteTime(vertexShaderFilePath), lastWriteTime(fragmentShaderFilePath) });
+	}
+
+	// GL thread
+	void Update(ShaderCompiler& compiler)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if(now - lastCheck < std::chrono::milliseconds(500))
+			return;
+		lastCheck = now;
+
+		// every file is only looked at once, however many programs use it
+		std::map<std::string, std::filesystem::file_time_type> times;
+		auto timeOf = [&](const std::string& path)
+		{
+			auto found = times.find(path);
+			if(found == times.end())
+				found = times.emplace(path, lastWriteTime(path)).first;
+			return found->second;
+		};
+
+		for(Program& program : programs)
+		{
+			auto vertexTime = timeOf(program.vertexShaderFilePath);
+			auto fragmentTime = timeOf(program.fragmentShaderFilePath);
+			if(vertexTime == program.vertexTime && fragmentTime == program.fragmentTime)
+				continue;
+
+			std::string vertexShaderSource = InjectDefines(ReadShaderFile(program.vertexShaderFilePath), program.defines);
+			std::string fragmentShaderSource = InjectDefines(ReadShaderFile(program.fragmentShaderFilePath), program.defines);
+			if(!compiler.Reload(program.handle, vertexShaderSource, fragmentShaderSource))
+				continue;	// tried again on the next check
+			std::cout << "reloading " << program.vertexShaderFilePath << " + " << program.fragmentShaderFilePath << std::endl;
+			program.vertexTime = vertexTime;
+			program.fragmentTime = fragmentTime;
+		}
+	}
+
+private:
+	struct Program
+	{
+		ShaderCompiler::Handle handle;
+		std::string vertexShaderFilePath, fragmentShaderFilePath, defines;
+		std::filesystem::file_time_type vertexTime, fragmentTime;
+	};
+	std::vector<Program> programs;
+	std::chrono::steady_clock::time_point lastCheck;
+
+	static std::filesystem::file_time_type lastWriteTime(const std::string& path)
+	{
+		std::error_code error;
+		return std::filesystem::last_write_time(path, error);
+	}
+};
 
 void FramebufferSizeChangedCallback(GLFWwindow* window, int width, int height);
 
+// GL objects the render thread needs to execute a FrameCommands
+struct RenderResources
+{
+	ShaderCompiler* shaders;
+	ShaderPermutations* mainShaders;
+	GLuint fallbackShader;		// drawn with while a main shader variant is compiling
+	ShaderCompiler::Handle depthShader, skyboxShader, skyShader;	// passes are skipped until these are ready
+	GpuCulling* gpuCulling;		// null when the CPU culls
+	GLuint gpuFallbackShader;
+	ShaderCompiler::Handle gpuDepthShader;
+	GLuint shadowFBO;
+	GLuint depthTextureWidth, depthTextureHeight;
+	GLuint objectVAO, cubeEbo;
+	GLint cubeIndicesSize;
+	GLuint skybox;		// 0 while the cubemap is still loading
+	GLuint prefilteredSkybox;	// 0 until prefiltered or loaded from the cache
+	GLuint ambientIrradianceUBO;
+	ReflectionProbes* probes;
+	GLuint emptyVAO;		// for the full-screen sky triangle
+	TextureCache* textureCache;
+	GLuint materialBuffer;		// per draw material texture locations, shader storage binding 1
+	GLuint transmittanceLUT, scatteringLUT;	// 0 until the atmosphere tables are ready
+	DynamicResolution* resolution;		// the main pass's target
+	ShaderCompiler::Handle upscaleShader;	// stretched linearly until ready
+	AntiAliasing* antiAliasing;
+	ShaderCompiler::Handle fxaaShader, smaaEdgesShader, smaaBlendShader, taaShader;	// the mode is skipped until ready
+};
+void RenderFrame(const RenderResources& resources, const FrameCommands& frame);
+// the material texture arrays take this unit and the following ones
+const GLuint MATERIAL_TEXTURE_UNIT = 6;
+
+// meshes use the coarsest level of detail whose error stays under this many pixels,
+// the shadow pass accepts SHADOW_LOD_BIAS times more
+const GLfloat LOD_PIXEL_ERROR = 1.0f;
+const GLfloat SHADOW_LOD_BIAS = 4.0f;
+
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+
+// Times the per frame transform, culling and draw key work at 1..N threads (run with --bench-jobs)
+void RunJobBenchmark();
+// Converts the skybox faces into a BC1 compressed, mipmapped DDS cubemap (run with --cook-skybox)
+int CookSkybox();
+// true if flag is one of the command line arguments, so flags can be combined
+bool HasArgument(int argc, char** argv, const string& flag);
+// the argument after flag, empty if flag is not there
+string ArgumentValue(int argc, char** argv, const string& flag);
 
 struct Vertex
 {
@@ -40,40 +247,291 @@ struct Vertex
 
 struct Texture
 {
-	unsigned int id;
-	string type;
+	shared_ptr<TextureCache::Image> image;
+	string type;		// texture_diffuse, texture_specular or texture_normal
 };
 
+class Mesh;
+
+// A draw that still has to go through culling and sorting
+struct DrawCandidate
+{
+	DrawItem item;
+	AABB bounds;		// world space
+	const Mesh* mesh = nullptr;	// for texture streaming, LODs and meshlets, null for the cube scene
+	size_t lod = 0, shadowLod = 0;
+};
+
+// Placement and animation of one of the objects in the cube scene.
+// Applied as scale, translate, then the two rotations (angles in degrees, speeds in degrees per second).
+struct ObjectAnimation
+{
+	glm::vec3 scale;
+	glm::vec3 translation;
+	glm::vec3 firstAxis;
+	GLfloat firstAngle, firstSpeed;
+	glm::vec3 secondAxis;
+	GLfloat secondAngle, secondSpeed;
+};
+
+glm::mat4 BuildObjectMatrix(const ObjectAnimation& object, GLfloat time)
+{
+	glm::mat4 matrix = glm::scale(glm::mat4(1.0f), object.scale);
+	matrix = glm::translate(matrix, object.translation);
+	if(object.firstAngle != 0.0f || object.firstSpeed != 0.0f)
+		matrix = glm::rotate(matrix, glm::radians(object.firstAngle + time * object.firstSpeed), object.firstAxis);
+	if(object.secondAngle != 0.0f || object.secondSpeed != 0.0f)
+		matrix = glm::rotate(matrix, glm::radians(object.secondAngle + time * object.secondSpeed), object.secondAxis);
+	return matrix;
+}
+
+// The two rotations of an object at time
+glm::quat ObjectRotation(const ObjectAnimation& object, GLfloat time)
+{
+	glm::quat rotation(1.0f, 0.0f, 0.0f, 0.0f);
+	if(object.firstAngle != 0.0f || object.firstSpeed != 0.0f)
+		rotation = rotation * glm::angleAxis(glm::radians(object.firstAngle + time * object.firstSpeed), glm::normalize(object.firstAxis));
+	if(object.secondAngle != 0.0f || object.secondSpeed != 0.0f)
+		rotation = rotation * glm::angleAxis(glm::radians(object.secondAngle + time * object.secondSpeed), glm::normalize(object.secondAxis));
+	return rotation;
+}
+
+// Adds an object as two nodes with the same result as BuildObjectMatrix: its scale (which
+// applies to the translation as well) and translation, with a child for the rotations.
+// Returns the child, the node to draw with and to animate.
+SceneGraph::NodeId AddObjectNodes(SceneGraph& graph, SceneGraph::NodeId parent, const ObjectAnimation& object)
+{
+	SceneGraph::NodeId placement = graph.Add(parent, object.scale * object.translation, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), object.scale);
+	return graph.Add(placement, glm::vec3(0.0f), ObjectRotation(object, 0.0f));
+}
+
+// Distance from the view to the nearest point of the bounds' sphere, at least the near plane's
+GLfloat NearestDistance(const AABB& bounds, const glm::vec3& viewPosition)
+{
+	glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+	GLfloat radius = glm::length(bounds.max - bounds.min) * 0.5f;
+	return std::max(glm::length(center - viewPosition) - radius, 0.1f);
+}
+
+// Largest scale factor along the transform's axes
+GLfloat MaxScale(const glm::mat4& transform)
+{
+	return std::max(glm::length(glm::vec3(transform[0])), std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+}
+
+// Vertices closer than this in every attribute are merged at import, in model units for positions
+const GLfloat WELD_EPSILON = 1e-5f;
+
+// Merges vertices whose attributes all round to the same multiple of epsilon (0 merges exact
+// copies only) into the first of them, remaps the indices and drops the triangles that became
+// degenerate. Returns how many vertices were removed. Values on both sides of a rounding
+// boundary stay apart, so a few duplicates survive but nothing further apart than epsilon merges.
+size_t WeldVertices(vector<Vertex>& vertices, vector<unsigned int>& indices, GLfloat epsilon)
+{
+	struct Key
+	{
+		int32_t attributes[8];
+		uint32_t color;
+	};
+	auto quantize = [epsilon](GLfloat value)
+	{
+		int32_t result;
+		if(epsilon <= 0.0f)
+		{
+			value += 0.0f;		// -0 and 0 are the same
+			memcpy(&result, &value, sizeof(result));
+		} else
+			result = int32_t(std::max(std::min(std::floor(double(value) / epsilon + 0.5), 2147483647.0), -2147483647.0));
+		return result;
+	};
+
+	vector<Key> keys(vertices.size());
+	for(size_t i = 0; i < vertices.size(); i++)
+	{
+		const Vertex& v = vertices[i];
+		const GLfloat attributes[8] = { v.x, v.y, v.z, v.nx, v.ny, v.nz, v.u, v.v };
+		for(int k = 0; k < 8; k++)
+			keys[i].attributes[k] = quantize(attributes[k]);
+		keys[i].color = uint32_t(v.r) | uint32_t(v.g) << 8 | uint32_t(v.b) << 16;
+	}
+
+	// open addressing, each slot holds the first vertex of a key
+	const uint32_t EMPTY = 0xFFFFFFFF;
+	size_t capacity = 16;
+	while(capacity < vertices.size() * 2)
+		capacity *= 2;
+	vector<uint32_t> slots(capacity, EMPTY);
+	vector<unsigned int> remap(vertices.size());
+	size_t kept = 0;
+	for(size_t i = 0; i < vertices.size(); i++)
+	{
+		uint32_t hash = keys[i].color * 0x9E3779B1u;
+		for(int32_t attribute : keys[i].attributes)
+			hash = (hash ^ uint32_t(attribute)) * 0x85EBCA77u;
+		for(size_t slot = (hash ^ hash >> 16) & (capacity - 1); ; slot = (slot + 1) & (capacity - 1))
+		{
+			if(slots[slot] == EMPTY)
+			{
+				slots[slot] = uint32_t(i);
+				remap[i] = unsigned(kept);
+				vertices[kept++] = vertices[i];
+				break;
+			}
+			if(memcmp(&keys[slots[slot]], &keys[i], sizeof(Key)) == 0)
+			{
+				remap[i] = remap[slots[slot]];
+				break;
+			}
+		}
+	}
+	size_t removed = vertices.size() - kept;
+	vertices.resize(kept);
+
+	size_t keptIndices = 0;
+	for(size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		unsigned int a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+		if(a == b || b == c || a == c)
+			continue;
+		indices[keptIndices++] = a;
+		indices[keptIndices++] = b;
+		indices[keptIndices++] = c;
+	}
+	indices.resize(keptIndices);
+	return removed;
+}
+
+// Sort key for a draw: state first (VAO, element buffer), then front to back
+uint64_t MakeDrawKey(const DrawCandidate& candidate, const glm::vec3& viewPosition)
+{
+	glm::vec3 center = (candidate.bounds.min + candidate.bounds.max) * 0.5f;
+	GLfloat distance = glm::length(center - viewPosition);
+
+	// positive floats keep their order when compared as integers
+	uint32_t distanceBits;
+	memcpy(&distanceBits, &distance, sizeof(distanceBits));
+
+	return (uint64_t(candidate.item.vao & 0xFFFF) << 48) | (uint64_t(candidate.item.ebo & 0xFFFF) << 32) | distanceBits;
+}
+
 class Mesh
 {
 public:
+	// A simplified version of the mesh, its indices follow the previous ones in the element buffer
+	struct Lod
+	{
+		GLuint firstIndex;
+		GLsizei indexCount;
+		GLfloat error;		// how far the surface moved, in model units
+		size_t firstMeshlet = 0, meshletCount = 0;
+	};
+	static const size_t MAX_LODS = 5;
+	static const size_t MIN_LOD_INDICES = 3 * 64;
+
 	vector<Vertex> vertices;
-	vector<unsigned int> indices;
+	vector<unsigned int> indices;	// every level of detail
+	vector<Lod> lods;		// full detail first
+	vector<Meshlet> meshlets;	// of every level of detail
 	vector<Texture> textures;
-	unsigned int VAO;
-
-	Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+	unsigned int VAO = 0;
+	AABB bounds;		// model space
+	GLfloat roughness = 0.5f;
+	size_t importedVertexCount;		// before welding
+	// the imported nodes from the file's root to the one holding this mesh, none if the file has no hierarchy
+	vector<SceneGraph::ImportedNode> nodePath;
+	SceneGraph::NodeId node = SceneGraph::NONE;	// set when its model takes it
+
+	Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, GLfloat weldEpsilon = WELD_EPSILON)
 	{
-		this->vertices = vertices;
-		this->indices = indices;
+		this->vertices = std::move(vertices);
+		this->indices = std::move(indices);
 		this->textures = textures;
 
-		setUpMesh();
+		importedVertexCount = this->vertices.size();
+		WeldVertices(this->vertices, this->indices, weldEpsilon);
+
+		for(const Vertex& vertex : this->vertices)
+			bounds.Extend(glm::vec3(vertex.x, vertex.y, vertex.z));
+		buildLods();
 	}
 
-	void Draw(GLuint shader, glm::mat4 transform)
+	void Record(vector<DrawCandidate>& draws, const glm::mat4& transform)
 	{
-		glUniformMatrix4fv(glGetUniformLocation(shader, "model"), 1, GL_FALSE, glm::value_ptr(transform));
+		DrawItem item = { VAO, 0, lods[0].indexCount, transform, roughness };
+		for(const Texture& texture : textures)
+		{
+			if(texture.type == "texture_diffuse")
+				item.diffuseMap = texture.image->Location();
+			else if(texture.type == "texture_specular")
+				item.specularMap = texture.image->Location();
+			else if(texture.type == "texture_normal")
+				item.normalMap = texture.image->Location();
+		}
+		draws.push_back({ item, bounds.Transformed(transform), this });
+	}
 
-		glBindVertexArray(VAO);
-		glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
+	// Asks for the texture mips this mesh needs on screen: its bounds' diameter in pixels
+	// (pixelsPerUnit is the size in pixels of one unit at distance 1) at their nearest point
+	void RequestTextures(TextureCache& textureCache, const AABB& worldBounds, const glm::vec3& viewPosition, GLfloat pixelsPerUnit) const
+	{
+		GLfloat diameter = glm::length(worldBounds.max - worldBounds.min);
+		GLfloat pixels = diameter / NearestDistance(worldBounds, viewPosition) * pixelsPerUnit;
+		for(const Texture& texture : textures)
+			textureCache.Need(*texture.image, pixels);
 	}
-private:
-	unsigned int VBO, EBO;
 
-	void setUpMesh()
+	// The coarsest level of detail whose error stays under maxPixels on screen
+	size_t SelectLod(const glm::mat4& transform, const AABB& worldBounds, const glm::vec3& viewPosition, GLfloat pixelsPerUnit, GLfloat maxPixels) const
 	{
+		GLfloat pixelsPerError = MaxScale(transform) / NearestDistance(worldBounds, viewPosition) * pixelsPerUnit;
+		size_t lod = 0;
+		while(lod + 1 < lods.size() && lods[lod + 1].error * pixelsPerError <= maxPixels)
+			lod++;
+		return lod;
+	}
+
+	void UseLod(DrawItem& item, size_t lod) const
+	{
+		item.firstIndex = lods[lod].firstIndex;
+		item.indexCount = lods[lod].indexCount;
+	}
+
+	// Keeps the meshlets of a level of detail that are in the frustum and face the viewer,
+	// as ranges appended to ranges. false if none are left.
+	bool CullMeshlets(DrawItem& item, size_t lod, const Frustum& frustum, const glm::vec3& viewPosition, vector<DrawRange>& ranges) const
+	{
+		// facing is checked in model space, the frustum in world space
+		glm::vec3 localView = glm::vec3(glm::inverse(item.model) * glm::vec4(viewPosition, 1.0f));
+		GLfloat scale = MaxScale(item.model);
+		item.firstRange = GLint(ranges.size());
+		for(size_t i = lods[lod].firstMeshlet; i < lods[lod].firstMeshlet + lods[lod].meshletCount; i++)
+		{
+			const Meshlet& meshlet = meshlets[i];
+			if(meshlet.FacesAway(localView) || !frustum.Intersects(glm::vec3(item.model * glm::vec4(meshlet.center, 1.0f)), meshlet.radius * scale))
+				continue;
+			if(ranges.size() > size_t(item.firstRange) && ranges.back().firstIndex + ranges.back().indexCount == meshlet.firstIndex)
+				ranges.back().indexCount += meshlet.indexCount;
+			else
+				ranges.push_back({ meshlet.firstIndex, GLsizei(meshlet.indexCount) });
+		}
+		item.rangeCount = GLsizei(ranges.size() - item.firstRange);
+		return item.rangeCount > 0;
+	}
+
+	// Creates the GL buffers. Needs the GL context, unlike the constructor.
+	// The data goes through the staging buffer when it is enabled; returns false without
+	// creating anything if this frame's staging segment is already too full.
+	bool Upload(StagingBuffer& staging)
+	{
+		GLsizeiptr vertexSize = vertices.size() * sizeof(Vertex);
+		GLsizeiptr indexSize = indices.size() * sizeof(unsigned int);
+
+		// room for both copies plus alignment, meshes bigger than a whole segment skip staging
+		GLsizeiptr stagingSize = vertexSize + indexSize + 16;
+		bool useStaging = staging.Enabled() && stagingSize <= staging.SegmentSize();
+		if(useStaging && !staging.Fits(stagingSize))
+			return false;
+
 		glGenVertexArrays(1, &VAO);
 		glGenBuffers(1, &VBO);
 		glGenBuffers(1, &EBO);
@@ -81,10 +539,10 @@ private:
 		glBindVertexArray(VAO);
 		glBindBuffer(GL_ARRAY_BUFFER, VBO);
 
-		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, vertexSize, useStaging ? nullptr : vertices.data(), GL_STATIC_DRAW);
 
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize, useStaging ? nullptr : indices.data(), GL_STATIC_DRAW);
 
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
@@ -92,33 +550,325 @@ private:
 		glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offsetof(Vertex, r)));
 		glEnableVertexAttribArray(2);
 		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, nx)));
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, u)));
 
 		glBindVertexArray(0);
+
+		if(useStaging)
+		{
+			staging.Copy(VBO, 0, vertices.data(), vertexSize);
+			staging.Copy(EBO, 0, indices.data(), indexSize);
+		}
+		return true;
+	}
+private:
+	unsigned int VBO, EBO;
+
+	// Each level halves the triangles of the previous one, until that no longer works
+	// without moving the surface by more than a tenth of the mesh's size
+	void buildLods()
+	{
+		lods.push_back({ 0, GLsizei(indices.size()), 0.0f });
+
+		// the simplifier merges vertices that only differ in the triangles using them
+		vector<glm::vec3> positions(vertices.size());
+		vector<unsigned int> order(vertices.size()), remap(vertices.size());
+		for(size_t i = 0; i < vertices.size(); i++)
+		{
+			positions[i] = glm::vec3(vertices[i].x, vertices[i].y, vertices[i].z);
+			order[i] = unsigned(i);
+		}
+		auto key = [this](unsigned int i)
+		{
+			const Vertex& v = vertices[i];
+			return std::tie(v.x, v.y, v.z, v.r, v.g, v.b, v.nx, v.ny, v.nz, v.u, v.v);
+		};
+		sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return key(a) < key(b) || (key(a) == key(b) && a < b); });
+		for(size_t i = 0; i < order.size(); i++)
+			remap[order[i]] = i > 0 && key(order[i]) == key(order[i - 1]) ? remap[order[i - 1]] : order[i];
+
+		GLfloat maxError = glm::length(bounds.max - bounds.min) * 0.1f;
+		vector<unsigned int> previous = indices;
+		while(lods.size() < MAX_LODS && previous.size() / 2 >= MIN_LOD_INDICES)
+		{
+			GLfloat error;
+			vector<unsigned int> simplified = simplify::Simplify(positions, remap, previous, previous.size() / 6 * 3, maxError, error);
+			if(simplified.size() > previous.size() * 3 / 4)
+				break;
+			// every level starts from the previous one, so the errors add up
+			lods.push_back({ GLuint(indices.size()), GLsizei(simplified.size()), lods.back().error + error });
+			indices.insert(indices.end(), simplified.begin(), simplified.end());
+			previous.swap(simplified);
+		}
+
+		// every level is split into meshlets for culling
+		for(Lod& lod : lods)
+		{
+			lod.firstMeshlet = meshlets.size();
+			BuildMeshlets(positions, indices, lod.firstIndex, lod.indexCount, meshlets);
+			lod.meshletCount = meshlets.size() - lod.firstMeshlet;
+		}
 	}
 };
 
 class Model
 {
 public:
-	Model(string const& path)
+	// Imports the file and passes every mesh to onMesh as soon as it is converted.
+	// Safe to call from a job, every thread has its own importer. OBJ files are parsed on
+	// jobs' threads. The material textures come from textureCache and show up once they
+	// have been decoded and uploaded.
+	void Load(string const& path, JobSystem& jobs, TextureCache& textureCache, const function<void(Mesh*)>& onMesh)
+	{
+		this->textureCache = &textureCache;
+		size_t meshCount = 0, importedVertices = 0, weldedVertices = 0;
+		auto count = [&](Mesh* mesh)
+		{
+			meshCount++;
+			importedVertices += mesh->importedVertexCount;
+			weldedVertices += mesh->vertices.size();
+			onMesh(mesh);
+		};
+		loadModel(path, jobs, count);
+		size_t staticCount = staticMeshes.size();
+		if(mergeStatic)
+			mergeStaticMeshes(count);
+		if(verbose)
+		{
+			cout << path << ": " << meshCount << " meshes, " << importedVertices << " -> " << weldedVertices << " vertices after welding";
+			if(mergeStatic)
+				cout << ", " << staticCount << " static meshes merged";
+			cout << endl;
+		}
+	}
+	// Vertices closer than this are merged by the meshes Load() creates, 0 only merges exact copies
+	GLfloat weldEpsilon = WELD_EPSILON;
+	// Set before Load() for models that never move their parts: the meshes are moved into the
+	// model's space and the ones sharing a material are merged, see mergeStaticMeshes()
+	bool mergeStatic = false;
+	// Load() prints a line with the model's mesh and vertex counts
+	bool verbose = false;
+
+	// merged meshes are split until they have at most MERGE_MAX_TRIANGLES triangles and are at
+	// most MERGE_CELL_SIZE times the model's size across, unless that leaves fewer than MERGE_MIN_TRIANGLES
+	static const size_t MERGE_MAX_TRIANGLES = 16384;
+	static const size_t MERGE_MIN_TRIANGLES = 512;
+	static constexpr GLfloat MERGE_CELL_SIZE = 0.25f;
+
+	// Main thread: the meshes' nodes go below root, in graph. Before any mesh is added.
+	void Attach(SceneGraph& graph, SceneGraph::NodeId root)
+	{
+		this->graph = &graph;
+		this->root = root;
+	}
+
+	// Main thread: takes ownership of an uploaded mesh, it gets drawn from the next Record on.
+	// The file's nodes on the way to it are added to the graph the first time they show up.
+	void AddMesh(Mesh* mesh)
 	{
-		loadModel(path);
+		SceneGraph::NodeId parent = root;
+		for(const SceneGraph::ImportedNode& imported : mesh->nodePath)
+		{
+			if(nodes.size() <= size_t(imported.index))
+				nodes.resize(imported.index + 1, SceneGraph::NONE);
+			if(nodes[imported.index] == SceneGraph::NONE)
+				nodes[imported.index] = graph->Add(parent, imported.translation, imported.rotation, imported.scale);
+			parent = nodes[imported.index];
+		}
+		mesh->node = parent;
+		meshes.emplace_back(mesh);
 	}
-	void Draw(GLuint shader, glm::mat4 transform)
+
+	// Main thread, with the graph updated
+	void Record(vector<DrawCandidate>& draws)
 	{
 		for(unsigned int i = 0; i < meshes.size(); i++)
 		{
-			meshes[i].Draw(shader, transform);
+			meshes[i]->Record(draws, graph->World(meshes[i]->node));
 		}
 
 	}
 private:
-	vector<Mesh> meshes;
+	vector<unique_ptr<Mesh>> meshes;
+	SceneGraph* graph = nullptr;
+	SceneGraph::NodeId root = SceneGraph::NONE;
+	vector<SceneGraph::NodeId> nodes;		// graph node of every imported node, NONE until used
 	string directory;
+	TextureCache* textureCache = nullptr;
+
+	// A mesh as it comes out of the file, before it becomes a Mesh
+	struct ImportedMesh
+	{
+		vector<Vertex> vertices;
+		vector<unsigned int> indices;
+		vector<Texture> textures;
+		GLfloat roughness = 0.5f;
+		vector<SceneGraph::ImportedNode> nodePath;
+	};
+	vector<ImportedMesh> staticMeshes;		// held back for mergeStaticMeshes()
+
+	void emit(ImportedMesh&& imported, const function<void(Mesh*)>& onMesh)
+	{
+		if(mergeStatic)
+		{
+			staticMeshes.push_back(std::move(imported));
+			return;
+		}
+		Mesh* mesh = new Mesh(std::move(imported.vertices), std::move(imported.indices), imported.textures, weldEpsilon);
+		mesh->roughness = imported.roughness;
+		mesh->nodePath = std::move(imported.nodePath);
+		onMesh(mesh);
+	}
 
-	void loadModel(string path)
+	// Moves the static meshes into model space through their nodes and appends the ones with the
+	// same textures and roughness into one vertex and index list. Each list is then split at the
+	// median triangle along its longest axis until the pieces are small enough to cull on their own.
+	void mergeStaticMeshes(const function<void(Mesh*)>& onMesh)
 	{
-		Assimp::Importer import;
+		struct Group
+		{
+			vector<Texture> textures;
+			GLfloat roughness;
+			vector<Vertex> vertices;
+			vector<unsigned int> indices;
+		};
+		vector<Group> groups;
+		map<tuple<const void*, const void*, const void*, GLfloat>, size_t> groupIndices;
+		AABB modelBounds;
+
+		for(ImportedMesh& imported : staticMeshes)
+		{
+			const void* maps[3] = { nullptr, nullptr, nullptr };
+			for(const Texture& texture : imported.textures)
+			{
+				int slot = texture.type == "texture_diffuse" ? 0 : texture.type == "texture_specular" ? 1 : 2;
+				maps[slot] = texture.image.get();
+			}
+			auto found = groupIndices.emplace(make_tuple(maps[0], maps[1], maps[2], imported.roughness), groups.size());
+			if(found.second)
+				groups.push_back({ imported.textures, imported.roughness });
+			Group& group = groups[found.first->second];
+
+			glm::mat4 transform(1.0f);
+			for(const SceneGraph::ImportedNode& node : imported.nodePath)
+				transform = glm::scale(transform * glm::translate(glm::mat4(1.0f), node.translation) * glm::mat4_cast(node.rotation), node.scale);
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+			bool mirrored = glm::determinant(glm::mat3(transform)) < 0.0f;
+
+			unsigned int firstVertex = unsigned(group.vertices.size());
+			for(Vertex vertex : imported.vertices)
+			{
+				glm::vec3 position = glm::vec3(transform * glm::vec4(vertex.x, vertex.y, vertex.z, 1.0f));
+				glm::vec3 normal = normalMatrix * glm::vec3(vertex.nx, vertex.ny, vertex.nz);
+				GLfloat length = glm::length(normal);
+				normal = length > 0.0f ? normal / length : normal;
+				vertex.x = position.x;
+				vertex.y = position.y;
+				vertex.z = position.z;
+				vertex.nx = normal.x;
+				vertex.ny = normal.y;
+				vertex.nz = normal.z;
+				modelBounds.Extend(position);
+				group.vertices.push_back(vertex);
+			}
+			for(size_t i = 0; i + 2 < imported.indices.size(); i += 3)
+			{
+				// a mirroring transform turns the triangles around
+				group.indices.push_back(firstVertex + imported.indices[i]);
+				group.indices.push_back(firstVertex + imported.indices[mirrored ? i + 2 : i + 1]);
+				group.indices.push_back(firstVertex + imported.indices[mirrored ? i + 1 : i + 2]);
+			}
+		}
+		staticMeshes.clear();
+		GLfloat maxSize = glm::length(modelBounds.max - modelBounds.min) * MERGE_CELL_SIZE;
+
+		vector<unsigned int> triangles;
+		vector<glm::vec3> centers;
+		vector<int> vertexMap;
+		for(Group& group : groups)
+		{
+			size_t triangleCount = group.indices.size() / 3;
+			triangles.resize(triangleCount);
+			centers.resize(triangleCount);
+			for(size_t t = 0; t < triangleCount; t++)
+			{
+				triangles[t] = unsigned(t);
+				centers[t] = glm::vec3(0.0f);
+				for(int k = 0; k < 3; k++)
+				{
+					const Vertex& vertex = group.vertices[group.indices[t * 3 + k]];
+					centers[t] += glm::vec3(vertex.x, vertex.y, vertex.z) / 3.0f;
+				}
+			}
+			vertexMap.assign(group.vertices.size(), -1);
+
+			function<void(size_t, size_t)> split = [&](size_t begin, size_t end)
+			{
+				AABB bounds;
+				for(size_t i = begin; i < end; i++)
+				{
+					for(int k = 0; k < 3; k++)
+					{
+						const Vertex& vertex = group.vertices[group.indices[triangles[i] * 3 + k]];
+						bounds.Extend(glm::vec3(vertex.x, vertex.y, vertex.z));
+					}
+				}
+				glm::vec3 size = bounds.max - bounds.min;
+				size_t count = end - begin;
+				if(count <= MERGE_MAX_TRIANGLES && (count < MERGE_MIN_TRIANGLES * 2 || glm::length(size) <= maxSize))
+				{
+					vector<Vertex> vertices;
+					vector<unsigned int> indices;
+					for(size_t i = begin; i < end; i++)
+					{
+						for(int k = 0; k < 3; k++)
+						{
+							unsigned int index = group.indices[triangles[i] * 3 + k];
+							if(vertexMap[index] == -1)
+							{
+								vertexMap[index] = int(vertices.size());
+								vertices.push_back(group.vertices[index]);
+							}
+							indices.push_back(unsigned(vertexMap[index]));
+						}
+					}
+					for(size_t i = begin; i < end; i++)
+					{
+						for(int k = 0; k < 3; k++)
+							vertexMap[group.indices[triangles[i] * 3 + k]] = -1;
+					}
+
+					Mesh* mesh = new Mesh(std::move(vertices), std::move(indices), group.textures, weldEpsilon);
+					mesh->roughness = group.roughness;
+					onMesh(mesh);
+					return;
+				}
+
+				int axis = size.x >= size.y && size.x >= size.z ? 0 : size.y >= size.z ? 1 : 2;
+				size_t middle = begin + count / 2;
+				nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end,
+					[&](unsigned int a, unsigned int b) { return centers[a][axis] < centers[b][axis]; });
+				split(begin, middle);
+				split(middle, end);
+			};
+			split(0, triangleCount);
+		}
+	}
+
+	void loadModel(string path, JobSystem& jobs, const function<void(Mesh*)>& onMesh)
+	{
+		size_t slash = path.find_last_of("/\\");
+		directory = slash == string::npos ? "." : path.substr(0, slash);
+
+		// OBJ files skip Assimp, which is still there for everything else and the OBJ files the fast path rejects
+		string extension = path.size() > 4 ? path.substr(path.size() - 4) : "";
+		transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+		if(extension == ".obj" && loadObj(path, jobs, onMesh))
+			return;
+
+		// one importer per thread so several models can be imported at the same time
+		static thread_local Assimp::Importer import;
 		const aiScene* scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
 
 		if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
@@ -126,28 +876,96 @@ private:
 			cout << "ERROR::ASSIMP::" << import.GetErrorString() << endl;
 			return;
 		}
-		directory = path.substr(0, path.find_last_of('/'));
 
-		processNode(scene->mRootNode, scene);
+		vector<SceneGraph::ImportedNode> nodePath;
+		int nodeCount = 0;
+		processNode(scene->mRootNode, scene, onMesh, nodePath, nodeCount);
+		import.FreeScene();
 	}
-	void processNode(aiNode* node, const aiScene* scene)
+	bool loadObj(const string& path, JobSystem& jobs, const function<void(Mesh*)>& onMesh)
 	{
+		vector<obj::Material> materials;
+		vector<obj::Mesh<Vertex>> meshes;
+		bool loaded = obj::Load<Vertex>(path, jobs, materials, meshes,
+			[](const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv, const obj::Material& material)
+		{
+			// the diffuse color goes into the vertex colors, like processMesh does
+			Vertex vertex;
+			vertex.x = position.x;
+			vertex.y = position.y;
+			vertex.z = position.z;
+			vertex.r = static_cast<GLubyte>(glm::clamp(material.diffuse.x, 0.0f, 1.0f) * 255.0f);
+			vertex.g = static_cast<GLubyte>(glm::clamp(material.diffuse.y, 0.0f, 1.0f) * 255.0f);
+			vertex.b = static_cast<GLubyte>(glm::clamp(material.diffuse.z, 0.0f, 1.0f) * 255.0f);
+			vertex.nx = normal.x;
+			vertex.ny = normal.y;
+			vertex.nz = normal.z;
+			vertex.u = uv.x;
+			vertex.v = uv.y;
+			return vertex;
+		});
+		if(!loaded)
+			return false;
+
+		obj::Material defaultMaterial;
+		for(obj::Mesh<Vertex>& mesh : meshes)
+		{
+			const obj::Material& material = mesh.material >= 0 ? materials[mesh.material] : defaultMaterial;
+			vector<Texture> textures;
+			if(mesh.hasUVs)
+			{
+				addTexture(material.diffuseMap, "texture_diffuse", textures);
+				addTexture(material.specularMap, "texture_specular", textures);
+				addTexture(material.normalMap, "texture_normal", textures);
+			}
+
+			ImportedMesh imported;
+			imported.vertices = std::move(mesh.vertices);
+			imported.indices = std::move(mesh.indices);
+			imported.textures = textures;
+			imported.roughness = sqrt(2.0f / (std::max(material.shininess, 0.0f) + 2.0f));
+			emit(std::move(imported), onMesh);
+		}
+		return true;
+	}
+	// path holds the nodes above this one, every node gets the next index in nodeCount
+	void processNode(aiNode* node, const aiScene* scene, const function<void(Mesh*)>& onMesh,
+		vector<SceneGraph::ImportedNode>& path, int& nodeCount)
+	{
+		aiVector3D scaling, position;
+		aiQuaternion rotation;
+		node->mTransformation.Decompose(scaling, rotation, position);
+		path.push_back({ nodeCount++, glm::vec3(position.x, position.y, position.z),
+			glm::quat(rotation.w, rotation.x, rotation.y, rotation.z), glm::vec3(scaling.x, scaling.y, scaling.z) });
+
 		for(unsigned int i = 0; i < node->mNumMeshes; i++)
 		{
 			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-			meshes.push_back(processMesh(mesh, scene));
+			ImportedMesh imported = processMesh(mesh, scene);
+			imported.nodePath = path;
+			emit(std::move(imported), onMesh);
 		}
 
 		for(unsigned int i = 0; i < node->mNumChildren; i++)
 		{
-			processNode(node->mChildren[i], scene);
+			processNode(node->mChildren[i], scene, onMesh, path, nodeCount);
 		}
+		path.pop_back();
 	}
-	Mesh processMesh(aiMesh* mesh, const aiScene* scene)
+	ImportedMesh processMesh(aiMesh* mesh, const aiScene* scene)
 	{
 		vector<Vertex> vertices;
 		vector<unsigned int> indices;
 		vector<Texture> textures;
+		aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+
+		// the diffuse color goes into the vertex colors, the diffuse map multiplies it
+		aiColor3D diffuseColor(1.0f, 1.0f, 1.0f);
+		material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
+		GLubyte r = static_cast<GLubyte>(std::min(diffuseColor.r, 1.0f) * 255.0f);
+		GLubyte g = static_cast<GLubyte>(std::min(diffuseColor.g, 1.0f) * 255.0f);
+		GLubyte b = static_cast<GLubyte>(std::min(diffuseColor.b, 1.0f) * 255.0f);
+
 		//processes vertices
 		for(unsigned int i = 0; i < mesh->mNumVertices; i++)
 		{
@@ -157,71 +975,799 @@ private:
 			vertex.y = mesh->mVertices[i].y;
 			vertex.z = mesh->mVertices[i].z;
 
+			vertex.r = r;
+			vertex.g = g;
+			vertex.b = b;
+
 			vertex.nx = mesh->mNormals[i].x;
 			vertex.ny = mesh->mNormals[i].y;
 			vertex.nz = mesh->mNormals[i].z;
 
-			//no textures first
-			vertex.u = 0.0f;
-			vertex.v = 0.0f;
+			if(mesh->mTextureCoords[0])
+			{
+				vertex.u = mesh->mTextureCoords[0][i].x;
+				vertex.v = mesh->mTextureCoords[0][i].y;
+			} else
+			{
+				vertex.u = 0.0f;
+				vertex.v = 0.0f;
+			}
+
+			vertices.push_back(vertex);
+		}
+		//process indices
+		for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+		{
+			aiFace face = mesh->mFaces[i];
+			for(unsigned int j = 0; j < face.mNumIndices; j++)
+			{
+				indices.push_back(face.mIndices[j]);
+			}
+		}
+
+		if(mesh->mTextureCoords[0])
+		{
+			loadMaterialTexture(material, aiTextureType_DIFFUSE, "texture_diffuse", textures);
+			loadMaterialTexture(material, aiTextureType_SPECULAR, "texture_specular", textures);
+			// OBJ files usually put normal maps in map_bump, which assimp reports as a height map
+			if(!loadMaterialTexture(material, aiTextureType_NORMALS, "texture_normal", textures))
+				loadMaterialTexture(material, aiTextureType_HEIGHT, "texture_normal", textures);
+		}
+
+		ImportedMesh result;
+		result.vertices = std::move(vertices);
+		result.indices = std::move(indices);
+		result.textures = textures;
+
+		// Blinn-Phong exponent to GGX roughness
+		float shininess;
+		if(material->Get(AI_MATKEY_SHININESS, shininess) == AI_SUCCESS)
+			result.roughness = sqrt(2.0f / (std::max(shininess, 0.0f) + 2.0f));
+
+		return result;
+	}
+	// The first texture of a type, relative to the model file. Embedded textures are not supported.
+	bool loadMaterialTexture(aiMaterial* material, aiTextureType type, const string& typeName, vector<Texture>& textures)
+	{
+		aiString path;
+		if(material->GetTextureCount(type) == 0 || material->GetTexture(type, 0, &path) != AI_SUCCESS || path.C_Str()[0] == '*')
+			return false;
+
+		string file = path.C_Str();
+		replace(file.begin(), file.end(), '\\', '/');
+		return addTexture(file, typeName, textures);
+	}
+	bool addTexture(const string& file, const string& typeName, vector<Texture>& textures)
+	{
+		if(file.empty())
+			return false;
+		textures.push_back({ textureCache->Acquire(directory + "/" + file), typeName });
+		return true;
+	}
+};
+
+// Imports models in the background and uploads them mesh by mesh, so scenes appear progressively.
+// A mesh travels worker -> GL thread (upload queue) -> main thread (ready queue),
+// which means a Model itself is only ever touched by the main thread.
+class AssetLoader
+{
+public:
+	AssetLoader(JobSystem& jobs, TextureCache& textureCache)
+		: jobs(jobs), textureCache(textureCache), uploadQueue(4096), readyQueue(4096)
+	{
+	}
+
+	~AssetLoader()
+	{
+		cancelled = true;
+		jobs.Wait(loadCounter);
+
+		PendingMesh pending;
+		while(uploadQueue.Pop(pending))
+			delete pending.mesh;
+		while(readyQueue.Pop(pending))
+			delete pending.mesh;
+		delete waitingForStaging.mesh;
+		delete waitingForMainThread.mesh;
+	}
+
+	// Starts importing path on a worker thread. model has to outlive the loader.
+	void LoadModel(Model& model, const string& path)
+	{
+		jobs.RunBackground([this, &model, path]
+		{
+			model.Load(path, jobs, textureCache, [this, &model](Mesh* mesh)
+			{
+				PendingMesh pending = { &model, mesh };
+				while(!uploadQueue.Push(pending))
+				{
+					if(cancelled)
+					{
+						delete mesh;
+						return;
+					}
+					this_thread::yield();
+				}
+			});
+		}, &loadCounter);
+	}
+
+	// GL thread, once per frame: uploads as many imported meshes as fit into this frame's staging segment
+	void UploadPending(StagingBuffer& staging)
+	{
+		if(waitingForMainThread.mesh)
+		{
+			if(!readyQueue.Push(waitingForMainThread))
+				return;
+			waitingForMainThread.mesh = nullptr;
+		}
+
+		staging.BeginFrame();
+		while(waitingForStaging.mesh || uploadQueue.Pop(waitingForStaging))
+		{
+			if(!waitingForStaging.mesh->Upload(staging))
+				break;
+
+			if(!readyQueue.Push(waitingForStaging))
+			{
+				waitingForMainThread = waitingForStaging;
+				waitingForStaging.mesh = nullptr;
+				break;
+			}
+			waitingForStaging.mesh = nullptr;
+		}
+		staging.EndFrame();
+	}
+
+	// Main thread, once per frame: gives the uploaded meshes to their models
+	void CollectUploaded()
+	{
+		PendingMesh pending;
+		while(readyQueue.Pop(pending))
+			pending.model->AddMesh(pending.mesh);
+	}
+
+private:
+	struct PendingMesh
+	{
+		Model* model;
+		Mesh* mesh;
+	};
+
+	JobSystem& jobs;
+	TextureCache& textureCache;
+	JobCounter loadCounter;
+	atomic<bool> cancelled{ false };
+	LockFreeQueue<PendingMesh> uploadQueue;
+	LockFreeQueue<PendingMesh> readyQueue;
+
+	// only used by the GL thread
+	PendingMesh waitingForStaging = { nullptr, nullptr };
+	PendingMesh waitingForMainThread = { nullptr, nullptr };
+};
+
+
+// Loads the skybox cubemap without blocking the main thread. Uses the cooked DDS file
+// (BC1 with mips, see --cook-skybox) when there is one, otherwise decodes the six JPEG
+// faces in parallel on worker threads. The upload happens on the GL thread through a pixel
+// buffer object into immutable texture storage. Until then the skybox and reflections use a fallback color.
+class SkyboxLoader
+{
+public:
+	~SkyboxLoader()
+	{
+		if(jobs)
+			jobs->Wait(decodeCounter);
+		for(unsigned char*& data : faceData)
+		{
+			stbi_image_free(data);
+			data = nullptr;
+		}
+	}
+
+	// Main thread: starts loading, faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+	void Start(JobSystem& jobs, const std::vector<std::string>& faces, const std::string& cookedPath)
+	{
+		this->jobs = &jobs;
+
+		if(std::ifstream(cookedPath).good())
+		{
+			pendingJobs = 1;
+			jobs.RunBackground([this, faces, cookedPath]
+			{
+				if(LoadCompressedCubemap(cookedPath, cooked))
+				{
+					if(!GLAD_GL_EXT_texture_compression_s3tc)
+						decodeCooked();
+				} else
+				{
+					std::cerr << "ERROR reading cooked skybox " << cookedPath << ", using the faces instead\n";
+					cooked.levels = 0;
+					for(size_t i = 0; i < faces.size() && i < 6; ++i)
+						decodeFace(i, faces[i]);
+				}
+				pendingJobs.fetch_sub(1, std::memory_order_release);
+			}, &decodeCounter);
+			return;
+		}
+
+		pendingJobs = 6;
+		for(size_t i = 0; i < faces.size() && i < 6; ++i)
+		{
+			std::string path = faces[i];
+			jobs.RunBackground([this, i, path]
+			{
+				decodeFace(i, path);
+				pendingJobs.fetch_sub(1, std::memory_order_release);
+			}, &decodeCounter);
+		}
+	}
+
+	// GL thread, once per frame: returns the cubemap once it has been uploaded, 0 before that
+	GLuint Update()
+	{
+		if(texture || failed || !jobs || pendingJobs.load(std::memory_order_acquire) > 0)
+			return texture;
+
+		if(cooked.levels > 0)
+			uploadCooked();
+		else
+			uploadFaces();
+		return texture;
+	}
+
+private:
+	struct FaceSize
+	{
+		int width, height, channels;
+	};
+
+	JobSystem* jobs = nullptr;
+	JobCounter decodeCounter;
+	std::atomic<int> pendingJobs{ 0 };
+	bool failed = false;
+	GLuint texture = 0;
+
+	// JPEG faces
+	unsigned char* faceData[6] = {};
+	FaceSize faceSizes[6] = {};
+
+	// cooked cubemap, plus its levels decoded to RGB if the driver has no S3TC
+	CompressedCubemap cooked;
+	std::vector<std::vector<unsigned char>> cookedRGB;
+
+	void decodeFace(size_t i, const std::string& path)
+	{
+		FaceSize& size = faceSizes[i];
+		faceData[i] = stbi_load(path.c_str(), &size.width, &size.height, &size.channels, 3);
+		if(!faceData[i])
+			std::cerr << "ERROR loading cubemap texture " << path << "\n";
+	}
+
+	void decodeCooked()
+	{
+		cookedRGB.resize(6 * cooked.levels);
+		for(int face = 0; face < 6; ++face)
+		{
+			for(int level = 0; level < cooked.levels; ++level)
+			{
+				int width = CompressedCubemap::LevelWidth(cooked.width, level);
+				int height = CompressedCubemap::LevelWidth(cooked.height, level);
+				std::vector<unsigned char>& rgb = cookedRGB[face * cooked.levels + level];
+				rgb.resize(size_t(width) * height * 3);
+				bc1::Decode(&cooked.data[cooked.Offset(face, level)], width, height, rgb.data());
+			}
+		}
+	}
+
+	void uploadFaces()
+	{
+		GLint width = faceSizes[0].width;
+		GLint height = faceSizes[0].height;
+		GLsizeiptr faceSize = GLsizeiptr(width) * height * 3;
+		for(int i = 0; i < 6; ++i)
+		{
+			if(!faceData[i] || faceSizes[i].width != width || faceSizes[i].height != height)
+			{
+				std::cerr << "ERROR cubemap faces are missing or differ in size\n";
+				failed = true;	// keep the fallback
+				return;
+			}
+		}
+
+		GLuint pixelBuffer;
+		glGenBuffers(1, &pixelBuffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, faceSize * 6, nullptr, GL_STREAM_DRAW);
+		unsigned char* mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, faceSize * 6, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+		for(int i = 0; i < 6; ++i)
+		{
+			memcpy(mapped + faceSize * i, faceData[i], faceSize);
+			stbi_image_free(faceData[i]);
+			faceData[i] = nullptr;
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		bool immutable = GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage;
+		if(immutable)
+			glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RGB8, width, height);
+
+		// rows of RGB data are not necessarily 4 byte aligned
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for(int i = 0; i < 6; ++i)
+		{
+			// with a PBO bound the data pointer is an offset into it
+			const void* offset = reinterpret_cast<const void*>(faceSize * i);
+			if(immutable)
+				glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, offset);
+			else
+				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, offset);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		// the driver keeps the buffer alive until the copies are done
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pixelBuffer);
+
+		setParameters(1);
+	}
+
+	void uploadCooked()
+	{
+		const GLenum format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		bool immutable = GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+
+		if(cookedRGB.empty())
+		{
+			// the blocks go from the file into the texture as they are
+			GLuint pixelBuffer;
+			glGenBuffers(1, &pixelBuffer);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, cooked.data.size(), cooked.data.data(), GL_STREAM_DRAW);
+
+			if(immutable)
+				glTexStorage2D(GL_TEXTURE_CUBE_MAP, cooked.levels, format, cooked.width, cooked.height);
+			for(int face = 0; face < 6; ++face)
+			{
+				for(int level = 0; level < cooked.levels; ++level)
+				{
+					GLsizei width = CompressedCubemap::LevelWidth(cooked.width, level);
+					GLsizei height = CompressedCubemap::LevelWidth(cooked.height, level);
+					GLsizei size = static_cast<GLsizei>(CompressedCubemap::LevelSize(cooked.width, cooked.height, level));
+					const void* offset = reinterpret_cast<const void*>(cooked.Offset(face, level));
+					if(immutable)
+						glCompressedTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, 0, 0, width, height, format, size, offset);
+					else
+						glCompressedTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, format, width, height, 0, size, offset);
+				}
+			}
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &pixelBuffer);
+		} else
+		{
+			// no S3TC on this driver, the levels were decoded on the worker thread
+			if(immutable)
+				glTexStorage2D(GL_TEXTURE_CUBE_MAP, cooked.levels, GL_RGB8, cooked.width, cooked.height);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			for(int face = 0; face < 6; ++face)
+			{
+				for(int level = 0; level < cooked.levels; ++level)
+				{
+					GLsizei width = CompressedCubemap::LevelWidth(cooked.width, level);
+					GLsizei height = CompressedCubemap::LevelWidth(cooked.height, level);
+					const unsigned char* rgb = cookedRGB[face * cooked.levels + level].data();
+					if(immutable)
+						glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+					else
+						glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+				}
+			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			cookedRGB.clear();
+		}
+
+		setParameters(cooked.levels);
+		cooked.data.clear();
+		cooked.data.shrink_to_fit();
+	}
+
+	void setParameters(int levels)
+	{
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	}
+};
+
+// Convolves the skybox into a GGX prefiltered cubemap whose mip levels go from mirror-like
+// (roughness 0) to fully rough (roughness 1), so a reflection in main.fsh is a single textureLod.
+// Computed once on worker threads and cached on disk, keyed by a hash of the skybox faces.
+// Also projects the skybox onto spherical harmonics for the diffuse ambient light.
+class EnvironmentPrefilter
+{
+public:
+	static const int SIZE = 256;
+	static const int LEVELS = 7;
+	static const uint32_t SAMPLE_COUNT = 64;
+	static const int SOURCE_SIZE = 512;
+
+	~EnvironmentPrefilter()
+	{
+		if(jobs)
+			jobs->Wait(counter);
+	}
+
+	// Main thread: starts loading the cache or prefiltering, faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+	void Start(JobSystem& jobs, const std::vector<std::string>& faces, const std::string& cachePath)
+	{
+		this->jobs = &jobs;
+		jobs.RunBackground([this, faces, cachePath]
+		{
+			// the parameters are part of the key so changing them invalidates the cache
+			uint64_t key = environment::HashFiles(faces, CACHE_VERSION * 1000003ull + SIZE * 131ull + LEVELS * 31ull + SAMPLE_COUNT);
+			if(!loadCache(cachePath, key))
+			{
+				if(prefilter(faces))
+					saveCache(cachePath, key);
+				else
+					failed = true;
+			}
+			if(!failed)
+				projectIrradiance();
+			done.store(true, std::memory_order_release);
+		}, &counter);
+	}
+
+	// Any thread: true once the prefiltered map and the irradiance are available
+	bool Ready() const
+	{
+		return done.load(std::memory_order_acquire) && !failed;
+	}
+
+	// Skybox radiance as spherical harmonics, only valid once Ready()
+	const SphericalHarmonics& Irradiance() const { return irradiance; }
+
+	// GL thread, once per frame: returns the prefiltered cubemap once uploaded, 0 before that
+	GLuint Update()
+	{
+		if(texture || !done.load(std::memory_order_acquire) || failed)
+			return texture;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		bool immutable = GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_storage;
+		if(immutable)
+			glTexStorage2D(GL_TEXTURE_CUBE_MAP, LEVELS, GL_RGB8, SIZE, SIZE);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for(int face = 0; face < 6; ++face)
+		{
+			for(int level = 0; level < LEVELS; ++level)
+			{
+				GLsizei size = result.LevelSize(level);
+				const unsigned char* data = result.faces[face][level].data();
+				if(immutable)
+					glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, 0, 0, size, size, GL_RGB, GL_UNSIGNED_BYTE, data);
+				else
+					glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB8, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+			}
+			result.faces[face].clear();
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, LEVELS - 1);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+		return texture;
+	}
+
+private:
+	static const uint32_t CACHE_MAGIC = 0x564E4550;	// "PENV"
+	static const uint32_t CACHE_VERSION = 1;
+
+	struct CacheHeader
+	{
+		uint32_t magic, version;
+		uint64_t key;
+		int32_t size, levels;
+	};
+
+	JobSystem* jobs = nullptr;
+	JobCounter counter;
+	std::atomic<bool> done{ false };
+	bool failed = false;		// written by the job before done, only read once done is seen
+	CubeMipChain result;
+	SphericalHarmonics irradiance;
+	GLuint texture = 0;
+
+	// mip 0 has roughness 0 so it is just the skybox, projected one face per job
+	void projectIrradiance()
+	{
+		SphericalHarmonics faces[6];
+		jobs->ParallelFor(0, 6, 1, [&](size_t begin, size_t end)
+		{
+			for(size_t face = begin; face < end; ++face)
+				faces[face] = environment::ProjectFace(result.faces[face][0].data(), SIZE, int(face));
+		});
+		for(const SphericalHarmonics& face : faces)
+			irradiance += face;
+	}
+
+	bool prefilter(const std::vector<std::string>& faces)
+	{
+		// the source is the skybox scaled down to SOURCE_SIZE with a full mip chain,
+		// rough levels read from its small mips instead of taking more samples
+		CubeMipChain source;
+		source.size = SOURCE_SIZE;
+		while((SOURCE_SIZE >> source.levels) > 0)
+			source.levels++;
+		for(int face = 0; face < 6 && face < int(faces.size()); ++face)
+		{
+			int width, height, channels;
+			unsigned char* data = stbi_load(faces[face].c_str(), &width, &height, &channels, 3);
+			if(!data || width != height || width < SOURCE_SIZE)
+			{
+				std::cerr << "ERROR prefiltering skybox face " << faces[face] << "\n";
+				stbi_image_free(data);
+				return false;
+			}
+			std::vector<unsigned char> level(data, data + size_t(width) * height * 3);
+			stbi_image_free(data);
+
+			for(; width > SOURCE_SIZE; width /= 2)
+				level = DownsampleRGB(level, width, width);
+			source.faces[face].push_back(level);
+			for(int i = 1; i < source.levels; ++i)
+			{
+				source.faces[face].push_back(DownsampleRGB(source.faces[face][i - 1], source.LevelSize(i - 1), source.LevelSize(i - 1)));
+			}
+		}
+
+		result.size = SIZE;
+		result.levels = LEVELS;
+		struct Row
+		{
+			int face, level, y;
+		};
+		std::vector<Row> rows;
+		for(int face = 0; face < 6; ++face)
+		{
+			for(int level = 0; level < LEVELS; ++level)
+			{
+				result.faces[face].emplace_back(size_t(result.LevelSize(level)) * result.LevelSize(level) * 3);
+				for(int y = 0; y < result.LevelSize(level); ++y)
+					rows.push_back({ face, level, y });
+			}
+		}
+
+		// one row per job keeps every job short, even when a frame's Wait() picks one up
+		jobs->ParallelFor(0, rows.size(), 1, [&](size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; ++i)
+			{
+				const Row& row = rows[i];
+				int size = result.LevelSize(row.level);
+				float roughness = float(row.level) / (LEVELS - 1);
+				unsigned char* texel = &result.faces[row.face][row.level][size_t(row.y) * size * 3];
+				for(int x = 0; x < size; ++x, texel += 3)
+				{
+					glm::vec3 normal = environment::TexelDirection(row.face, x, row.y, size);
+					glm::vec3 color = environment::PrefilterGGX(source, normal, roughness, SAMPLE_COUNT);
+					for(int c = 0; c < 3; ++c)
+						texel[c] = static_cast<unsigned char>(glm::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+				}
+			}
+		});
+		return true;
+	}
+
+	bool loadCache(const std::string& path, uint64_t key)
+	{
+		std::ifstream file(path, std::ios::binary);
+		CacheHeader header = {};
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if(!file || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.key != key
+			|| header.size != SIZE || header.levels != LEVELS)
+			return false;
+
+		result.size = SIZE;
+		result.levels = LEVELS;
+		for(int face = 0; face < 6; ++face)
+		{
+			for(int level = 0; level < LEVELS; ++level)
+			{
+				std::vector<unsigned char> data(size_t(result.LevelSize(level)) * result.LevelSize(level) * 3);
+				file.read(reinterpret_cast<char*>(data.data()), data.size());
+				result.faces[face].push_back(std::move(data));
+			}
+		}
+		if(!file)
+		{
+			result = CubeMipChain();
+			return false;
+		}
+		return true;
+	}
+
+	void saveCache(const std::string& path, uint64_t key)
+	{
+		std::ofstream file(path, std::ios::binary);
+		CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, key, SIZE, LEVELS };
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for(int face = 0; face < 6; ++face)
+		{
+			for(const std::vector<unsigned char>& data : result.faces[face])
+				file.write(reinterpret_cast<const char*>(data.data()), data.size());
+		}
+		if(!file)
+			std::cerr << "ERROR writing prefiltered skybox cache " << path << "\n";
+	}
+};
+
+// Precomputes the atmosphere's lookup tables for the sky (see Atmosphere.h) on worker threads,
+// cached on disk since they only depend on constants.
+class AtmosphereTables
+{
+public:
+	~AtmosphereTables()
+	{
+		if(jobs)
+			jobs->Wait(counter);
+	}
 
-			vertices.push_back(vertex);
-		}
-		//process indices
-		for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+	// Main thread: starts loading the cache or computing the tables
+	void Start(JobSystem& jobs, const std::string& cachePath)
+	{
+		this->jobs = &jobs;
+		jobs.RunBackground([this, cachePath]
 		{
-			aiFace face = mesh->mFaces[i];
-			for(unsigned int j = 0; j < face.mNumIndices; j++)
+			tables.transmittance.resize(size_t(atmosphere::TRANSMITTANCE_WIDTH) * atmosphere::TRANSMITTANCE_HEIGHT * 3);
+			tables.scattering.resize(size_t(atmosphere::SCATTERING_MU) * atmosphere::SCATTERING_MU_S * atmosphere::SCATTERING_NU * 4);
+			if(!loadCache(cachePath))
 			{
-				indices.push_back(face.mIndices[j]);
+				// scattering reads the whole transmittance table, so one after the other
+				this->jobs->ParallelFor(0, atmosphere::TRANSMITTANCE_HEIGHT, 1, [this](size_t begin, size_t end)
+				{
+					for(size_t row = begin; row < end; ++row)
+						atmosphere::ComputeTransmittanceRow(tables, int(row));
+				});
+				this->jobs->ParallelFor(0, atmosphere::SCATTERING_MU_S * atmosphere::SCATTERING_NU, 1, [this](size_t begin, size_t end)
+				{
+					for(size_t line = begin; line < end; ++line)
+						atmosphere::ComputeScatteringLine(tables, int(line % atmosphere::SCATTERING_MU_S), int(line / atmosphere::SCATTERING_MU_S));
+				});
+				saveCache(cachePath);
 			}
-		}
+			done.store(true, std::memory_order_release);
+		}, &counter);
+	}
 
-		/*if (mesh->mMaterialIndex >= 0)
-		{
-			aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-			vector<Texture> diffuseMaps = loadMaterialTexture(material, aiTextureType_DIFFUSE, "texture_diffuse");
-			textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-			vector<Texture> specularMaps = loadMaterialTexture(material, aiTextureType_SPECULAR, "texture_specular");
-			textures.insert(texture.end(), specularMaps.begin(), specularMaps.end());
-		}*/
+	// GL thread, once per frame: true once the tables are uploaded
+	bool Update()
+	{
+		if(uploaded || !done.load(std::memory_order_acquire))
+			return uploaded;
+
+		glGenTextures(1, &transmittanceTexture);
+		glBindTexture(GL_TEXTURE_2D, transmittanceTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, atmosphere::TRANSMITTANCE_WIDTH, atmosphere::TRANSMITTANCE_HEIGHT, 0, GL_RGB, GL_FLOAT, tables.transmittance.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &scatteringTexture);
+		glBindTexture(GL_TEXTURE_3D, scatteringTexture);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, atmosphere::SCATTERING_MU, atmosphere::SCATTERING_MU_S, atmosphere::SCATTERING_NU, 0, GL_RGBA, GL_FLOAT, tables.scattering.data());
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+		tables = atmosphere::Tables();
+		uploaded = true;
+		return true;
+	}
+
+	GLuint TransmittanceTexture() const { return transmittanceTexture; }
+	GLuint ScatteringTexture() const { return scatteringTexture; }
 
-		return Mesh(vertices, indices, textures);
+	// GL thread
+	void Destroy()
+	{
+		glDeleteTextures(1, &transmittanceTexture);
+		glDeleteTextures(1, &scatteringTexture);
+		transmittanceTexture = scatteringTexture = 0;
+		uploaded = false;
 	}
 
-};
+private:
+	static const uint32_t CACHE_MAGIC = 0x534F4D41;	// "AMOS"
+	static const uint32_t CACHE_VERSION = 1;
 
+	struct CacheHeader
+	{
+		uint32_t magic, version;
+		int32_t transmittanceWidth, transmittanceHeight;
+		int32_t scatteringMu, scatteringMuS, scatteringNu;
+	};
 
-GLuint loadSkybox(std::vector<std::string> faces)
-{
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+	JobSystem* jobs = nullptr;
+	JobCounter counter;
+	std::atomic<bool> done{ false };
+	atmosphere::Tables tables;
+	bool uploaded = false;
+	GLuint transmittanceTexture = 0;
+	GLuint scatteringTexture = 0;
 
-	GLint width, height, numOfChannels;
-	for(size_t i = 0; i < faces.size(); ++i)
+	static CacheHeader expectedHeader()
 	{
-		unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &numOfChannels, 0);
-		if(data)
-		{
-			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-				0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		} else
-			std::cerr << "ERROR loading cubemap texture\n";
-		stbi_image_free(data);
+		return { CACHE_MAGIC, CACHE_VERSION, atmosphere::TRANSMITTANCE_WIDTH, atmosphere::TRANSMITTANCE_HEIGHT,
+			atmosphere::SCATTERING_MU, atmosphere::SCATTERING_MU_S, atmosphere::SCATTERING_NU };
 	}
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-	return textureID;
-}
+	bool loadCache(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		CacheHeader header = {};
+		CacheHeader expected = expectedHeader();
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if(!file || memcmp(&header, &expected, sizeof(header)) != 0)
+			return false;
+
+		file.read(reinterpret_cast<char*>(tables.transmittance.data()), tables.transmittance.size() * sizeof(float));
+		file.read(reinterpret_cast<char*>(tables.scattering.data()), tables.scattering.size() * sizeof(float));
+		return bool(file);
+	}
+
+	void saveCache(const std::string& path)
+	{
+		std::ofstream file(path, std::ios::binary);
+		CacheHeader header = expectedHeader();
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(tables.transmittance.data()), tables.transmittance.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(tables.scattering.data()), tables.scattering.size() * sizeof(float));
+		if(!file)
+			std::cerr << "ERROR writing atmosphere cache " << path << "\n";
+	}
+};
 
 GLFWwindow* window;
 void getInput();
 
+// skybox faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X order, and the file --cook-skybox turns them into
+const std::vector<std::string> skyboxFaces{
+	"./skybox/right.jpg",
+	"./skybox/left.jpg",
+	"./skybox/top.jpg",
+	"./skybox/bottom.jpg",
+	"./skybox/front.jpg",
+	"./skybox/back.jpg"
+};
+const std::string skyboxCookedPath = "./skybox/skybox.dds";
+const std::string skyboxPrefilteredPath = "./skybox/prefiltered.bin";
+const std::string atmosphereCachePath = "./skybox/atmosphere.bin";
+
+// linked programs from earlier runs, see CreateShaderProgram
+ProgramCache programCache;
+const std::string programCachePath = "./shaders.cache";
+// every program from RequestShaderProgram, for hot reloading
+ShaderWatcher shaderWatcher;
+
 // window size
 GLfloat windowWidth, windowHeight;
 
@@ -242,9 +1788,19 @@ GLfloat currentTime, deltaTime, lastTime;
 // what to render
 int toggle(0);
 bool reflectionToggle(false);
+// 8x MSAA is what the window used to be created with
+int antiAliasingMode(AntiAliasing::MSAA_8X);
 
-int main()
+int main(int argc, char** argv)
 {
+	if(argc > 1 && string(argv[1]) == "--bench-jobs")
+	{
+		RunJobBenchmark();
+		return 0;
+	}
+	if(argc > 1 && string(argv[1]) == "--cook-skybox")
+		return CookSkybox();
+
 	// Initialize GLFW
 	int glfwInitStatus = glfwInit();
 	if(glfwInitStatus == GLFW_FALSE)
@@ -253,14 +1809,13 @@ int main()
 		return 1;
 	}
 
-	// Tell GLFW that we prefer to use OpenGL 3.3
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	// Tell GLFW that we need OpenGL 4.3, main.vsh and main.fsh read their draws from SSBOs
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 
 	// Tell GLFW that we prefer to use the modern OpenGL
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_SAMPLES, 8);
 
 	// Tell GLFW to create a window
 	windowWidth = 800;
@@ -268,7 +1823,7 @@ int main()
 	window = glfwCreateWindow(windowWidth, windowHeight, "FINALS", nullptr, nullptr);
 	if(window == nullptr)
 	{
-		std::cerr << "Failed to create GLFW window!" << std::endl;
+		std::cerr << "Failed to create GLFW window! OpenGL 4.3 is required." << std::endl;
 		glfwTerminate();
 		return 1;
 	}
@@ -285,6 +1840,29 @@ int main()
 		std::cerr << "Failed to initialize GLAD!" << std::endl;
 		return 1;
 	}
+	if(!GLAD_GL_VERSION_4_3)
+	{
+		std::cerr << "OpenGL 4.3 is required, the context is " << glGetString(GL_VERSION) << std::endl;
+		glfwTerminate();
+		return 1;
+	}
+	programCache.Open(programCachePath);
+	ShaderCompiler shaderCompiler;
+	shaderCompiler.Start(window, programCache);
+
+	// Import the models in the background, their meshes show up as they finish uploading
+	JobSystem jobs;
+	// shared by the models' materials, so it has to outlive them
+	TextureCache textureCache(jobs);
+	Model bedroom, monkey;
+	AssetLoader loader(jobs, textureCache);
+	bedroom.mergeStatic = true;
+	bedroom.verbose = monkey.verbose = HasArgument(argc, argv, "--verbose");
+	loader.LoadModel(bedroom, "Bedroom.obj");
+	loader.LoadModel(monkey, "Monkey.obj");
+
+	StagingBuffer staging;
+	staging.Create(8 * 1024 * 1024);
 
 	// vertex specification
 	// Position	 Color  Normal
@@ -373,17 +1951,17 @@ int main()
 		vertices[i + 3].nz = normal.z;
 	}
 
-	// vertex order for EBO
+	// vertex order for EBO, counterclockwise from the outside for face culling
 	GLuint cubeIndices[] = {
-			0, 1, 2, 0, 2, 3,
-			4, 5, 6, 4, 6, 7,
-			8, 9, 10, 8, 10, 11,
-			12, 13, 14, 12, 14, 15,
-			16, 17, 18, 16, 18, 19,
-			20, 21, 22, 20, 22, 23 };
+			0, 2, 1, 0, 3, 2,
+			4, 6, 5, 4, 7, 6,
+			8, 10, 9, 8, 11, 10,
+			12, 14, 13, 12, 15, 14,
+			16, 18, 17, 16, 19, 18,
+			20, 22, 21, 20, 23, 22 };
 
 	GLuint planeIndices[] = {
-			24, 25, 26, 24, 26, 27 };
+			24, 26, 25, 24, 27, 26 };
 
 	// VBO setup
 	GLuint vbo;
@@ -440,31 +2018,128 @@ int main()
 	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		std::cerr << "Framebuffer incomplete...\n";
 
-	std::vector<std::string> faces{
-		"./skybox/right.jpg",
-		"./skybox/left.jpg",
-		"./skybox/top.jpg",
-		"./skybox/bottom.jpg",
-		"./skybox/front.jpg",
-		"./skybox/back.jpg"
-	};
-	GLuint skybox = loadSkybox(faces);
+	SkyboxLoader skyboxLoader;
+	skyboxLoader.Start(jobs, skyboxFaces, skyboxCookedPath);
+	EnvironmentPrefilter environmentPrefilter;
+	environmentPrefilter.Start(jobs, skyboxFaces, skyboxPrefilteredPath);
 
-	GLuint mainShader = CreateShaderProgram("main.vsh", "main.fsh");
-	GLuint depthShader = CreateShaderProgram("depth.vsh", "depth.fsh");
-	GLuint skyboxShader = CreateShaderProgram("skybox.vsh", "skybox.fsh");
+	// Programs compile in the background while the assets load. The main shader's variants
+	// are requested by the render thread when first drawn with, except for the usual ones below.
+	ShaderPermutations mainShaders(shaderCompiler, "main.vsh", "main.fsh", [](GLuint program)
+	{
+		glUniform1i(glGetUniformLocation(program, "skybox"), 0);
+		glUniform1i(glGetUniformLocation(program, "shadowMap"), 1);
+		glUniform1i(glGetUniformLocation(program, "prefilteredSkybox"), 2);
+		glUniform1f(glGetUniformLocation(program, "prefilteredMaxLod"), EnvironmentPrefilter::LEVELS - 1);
+		glUniform1i(glGetUniformLocation(program, "reflectionProbes"), 3);
+		glUniform1f(glGetUniformLocation(program, "probeMaxLod"), ReflectionProbes::LEVELS - 1);
+		GLint materialUnits[TextureCache::MAX_ARRAYS];
+		for(int i = 0; i < TextureCache::MAX_ARRAYS; i++)
+			materialUnits[i] = MATERIAL_TEXTURE_UNIT + i;
+		glUniform1iv(glGetUniformLocation(program, "materialArrays"), TextureCache::MAX_ARRAYS, materialUnits);
+	});
+	for(bool reflection : { false, true })
+	{
+		ShaderFeatures features;
+		features.reflection = reflection;
+		mainShaders.Get(features);
+		features.shadowFilter = ShaderFeatures::SHADOW_HARD;
+		mainShaders.Get(features);
+	}
+	// small enough to compile right away, so there is always something to draw with
+	GLuint fallbackShader = CreateShaderProgram("main.vsh", "fallback.fsh");
+	ShaderCompiler::Handle depthShader = RequestShaderProgram(shaderCompiler, "depth.vsh", "depth.fsh");
+	ShaderCompiler::Handle skyboxShader = RequestShaderProgram(shaderCompiler, "skybox.vsh", "skybox.fsh", "", [](GLuint program)
+	{
+		glUniform1i(glGetUniformLocation(program, "skybox"), 0);
+	});
 
-	glUseProgram(mainShader);
-	glUniform1i(glGetUniformLocation(mainShader, "skybox"), 0);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, depthTexture);
-	glUniform1i(glGetUniformLocation(mainShader, "shadowMap"), 1);
+	glActiveTexture(GL_TEXTURE0);
+
+	// the sky replaces the skybox pass once the atmosphere tables are ready
+	ShaderCompiler::Handle skyShader = RequestShaderProgram(shaderCompiler, "sky.vsh", "sky.fsh", "", [](GLuint program)
+	{
+		glUniform1i(glGetUniformLocation(program, "transmittanceLUT"), 4);
+		glUniform1i(glGetUniformLocation(program, "scatteringLUT"), 5);
+		glUniform3fv(glGetUniformLocation(program, "rayleighScattering"), 1, glm::value_ptr(atmosphere::RAYLEIGH_SCATTERING));
+		glUniform1f(glGetUniformLocation(program, "mieG"), atmosphere::MIE_G);
+	});
+	GLuint emptyVAO;
+	glGenVertexArrays(1, &emptyVAO);
+
+	// the GPU culls and submits the scene when it can, run with --cpu-culling to compare
+	bool cpuCulling = HasArgument(argc, argv, "--cpu-culling");
+	GpuCulling gpuCulling;
+	bool gpuDriven = !cpuCulling && GpuCulling::Supported() && gpuCulling.Create(ReadShaderFile("cull.csh"));
+	GLuint gpuFallbackShader = 0;
+	ShaderCompiler::Handle gpuDepthShader = 0;
+	if(gpuDriven)
+	{
+		gpuFallbackShader = CreateShaderProgram("main.vsh", "fallback.fsh", GPU_DRIVEN_DEFINE);
+		gpuDepthShader = RequestShaderProgram(shaderCompiler, "depth.vsh", "depth.fsh", GPU_DRIVEN_DEFINE);
+		for(bool reflection : { false, true })
+		{
+			ShaderFeatures features;
+			features.reflection = reflection;
+			features.gpuDriven = true;
+			mainShaders.Get(features);
+		}
+	}
+	std::cout << (gpuDriven ? "culling on the GPU" : "culling on the CPU") << std::endl;
 
-	glUseProgram(skyboxShader);
-	glUniform1i(glGetUniformLocation(skyboxShader, "skybox"), 0);
+	AtmosphereTables atmosphereTables;
+	atmosphereTables.Start(jobs, atmosphereCachePath);
 
 	glEnable(GL_MULTISAMPLE);
 	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	// the small prefiltered mips show seams otherwise
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+	// uniform block 0 of main.fsh, filled every frame
+	GLuint ambientIrradianceUBO;
+	glGenBuffers(1, &ambientIrradianceUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, ambientIrradianceUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameCommands::ambientIrradiance), nullptr, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ambientIrradianceUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// shader storage block 1 of main.fsh, refilled for every list of draws
+	GLuint materialBuffer;
+	glGenBuffers(1, &materialBuffer);
+
+	ReflectionProbes reflectionProbes;
+	reflectionProbes.Create();
+
+	// the main pass renders offscreen at a resolution that keeps the GPU time on target,
+	// run with --fixed-resolution to always render at the window's size
+	DynamicResolution dynamicResolution;
+	dynamicResolution.Create(!HasArgument(argc, argv, "--fixed-resolution"));
+	ShaderCompiler::Handle upscaleShader = RequestShaderProgram(shaderCompiler, "fullscreen.vsh", "upscale.fsh", "", [](GLuint program)
+	{
+		glUniform1i(glGetUniformLocation(program, "source"), 0);
+	});
+
+	// anti-aliasing of the main pass, picked with --aa <mode> and cycled with A at runtime
+	AntiAliasing antiAliasing;
+	antiAliasing.Create();
+	int requestedMode = AntiAliasing::Parse(ArgumentValue(argc, argv, "--aa"));
+	if(requestedMode != -1)
+		antiAliasingMode = requestedMode;
+	auto postSetup = [](GLuint program)
+	{
+		glUniform1i(glGetUniformLocation(program, "source"), 0);
+		glUniform1i(glGetUniformLocation(program, "edges"), 2);
+		glUniform1i(glGetUniformLocation(program, "history"), 2);
+		glUniform1i(glGetUniformLocation(program, "depth"), 3);
+	};
+	ShaderCompiler::Handle fxaaShader = RequestShaderProgram(shaderCompiler, "fullscreen.vsh", "fxaa.fsh", "", postSetup);
+	ShaderCompiler::Handle smaaEdgesShader = RequestShaderProgram(shaderCompiler, "fullscreen.vsh", "smaaEdges.fsh", "", postSetup);
+	ShaderCompiler::Handle smaaBlendShader = RequestShaderProgram(shaderCompiler, "fullscreen.vsh", "smaaBlend.fsh", "", postSetup);
+	ShaderCompiler::Handle taaShader = RequestShaderProgram(shaderCompiler, "fullscreen.vsh", "taa.fsh", "", postSetup);
+	std::cout << "anti-aliasing: " << AntiAliasing::Name(antiAliasingMode) << std::endl;
 
 	GLint cubeIndicesSize = sizeof(cubeIndices) / sizeof(cubeIndices[0]);
 	GLint planeIndicesSize = sizeof(planeIndices) / sizeof(planeIndices[0]);
@@ -480,16 +2155,108 @@ int main()
 	glm::mat4 directionalLightProjectionMatrix = glm::ortho(-20.0f, 20.0f, -50.0f, 50.0f, 0.0f, 30.0f);
 	glm::mat4 directionalLightViewMatrix = glm::lookAt(directionalLightPosition, directionalLightPosition + directionalLightDirection, glm::vec3(0, 1, 0));
 
-	Model bedroom = Model("Bedroom.obj");
-	Model monkey = Model("Monkey.obj");
 
 	glm::vec3 skyboxColor(0.0f, 0.0f, 0.0f);
 
 
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
-
-	// identity matrix
-	glm::mat4 iMatrix(1.0f);
+	glfwSetKeyCallback(window, key_callback);
+
+	// scale, translation, then up to two rotations for everything in the scenes
+	enum { FIRST_CUBE, PLANE = 5, BEDROOM, MONKEY, SKYBOX, OBJECT_COUNT };
+	const ObjectAnimation sceneObjects[OBJECT_COUNT] = {
+		// cubes
+		{ glm::vec3(6.0f, 6.0f, 6.0f), glm::vec3(-1.5f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 23.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		{ glm::vec3(4.5f, 4.5f, 4.5f), glm::vec3(1.5f, 0.5f, 1.5f), glm::vec3(0.0f, 0.0f, 1.0f), 90.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		{ glm::vec3(3.0f, 3.0f, 3.0f), glm::vec3(2.5f, 2.0f, -2.0f), glm::vec3(1.0f, 1.0f, 1.0f), 0.0f, 40.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		{ glm::vec3(1.5f, 1.5f, 1.5f), glm::vec3(-2.0f, 3.5f, 5.0f), glm::vec3(0.0f, 1.0f, 0.0f), 45.0f, 0.0f, glm::vec3(0.0f, 0.0f, 1.0f), -90.0f, 0.0f },
+		{ glm::vec3(1.5f, 6.0f, 1.5f), glm::vec3(-0.0f, 0.8f, -5.0f), glm::vec3(1.0f, 1.0f, 0.0f), 23.0f, 0.0f, glm::vec3(1.0f, 0.0f, 0.0f), 0.0f, 60.0f },
+		// plane
+		{ glm::vec3(30.0f, 1.0f, 30.0f), glm::vec3(0.0f, -0.5f, 0.0f), glm::vec3(0.0f), 0.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		// bedroom
+		{ glm::vec3(7.0f, 7.0f, 7.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), -90.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		// monkey
+		{ glm::vec3(3.0f, 3.0f, 3.0f), glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+		// skybox
+		{ glm::vec3(50.0f, 50.0f, 50.0f), glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, 0.0f, glm::vec3(0.0f), 0.0f, 0.0f },
+	};
+	// every object is its own little hierarchy, the models' nodes go below theirs
+	SceneGraph sceneGraph;
+	SceneGraph::NodeId objectNodes[OBJECT_COUNT];
+	for(int i = 0; i < OBJECT_COUNT; i++)
+		objectNodes[i] = AddObjectNodes(sceneGraph, SceneGraph::NONE, sceneObjects[i]);
+	bedroom.Attach(sceneGraph, objectNodes[BEDROOM]);
+	monkey.Attach(sceneGraph, objectNodes[MONKEY]);
+
+	// from mirror-like to fully rough, to show off the prefiltered reflections
+	const GLfloat cubeRoughness[PLANE - FIRST_CUBE] = { 0.0f, 0.25f, 0.5f, 0.75f, 1.0f };
+	const GLfloat planeRoughness = 0.4f;
+
+	// the cube and the plane share the same vertices
+	AABB cubeBounds;
+	cubeBounds.Extend(glm::vec3(-0.5f, -0.5f, -0.5f));
+	cubeBounds.Extend(glm::vec3(0.5f, 0.5f, 0.5f));
+
+	// per frame culling and sorting state, kept around to reuse the allocations
+	enum { VISIBLE_MAIN = 1, VISIBLE_SHADOW = 2 };
+	vector<DrawCandidate> candidates;
+	vector<uint8_t> candidateVisibility;
+	vector<uint64_t> candidateKeys;
+	vector<size_t> drawOrder;
+	vector<GLint> probeLayers;
+	// TAA's jitter sequence and the camera it reprojects from
+	unsigned int frameIndex = 0;
+	glm::mat4 previousViewProjection(1.0f);
+
+	RenderResources resources;
+	resources.shaders = &shaderCompiler;
+	resources.mainShaders = &mainShaders;
+	resources.fallbackShader = fallbackShader;
+	resources.depthShader = depthShader;
+	resources.skyboxShader = skyboxShader;
+	resources.skyShader = skyShader;
+	resources.gpuCulling = gpuDriven ? &gpuCulling : nullptr;
+	resources.gpuFallbackShader = gpuFallbackShader;
+	resources.gpuDepthShader = gpuDepthShader;
+	resources.shadowFBO = shadowFBO;
+	resources.depthTextureWidth = depthTextureWidth;
+	resources.depthTextureHeight = depthTextureHeight;
+	resources.objectVAO = objectVAO;
+	resources.cubeEbo = cubeEbo;
+	resources.cubeIndicesSize = cubeIndicesSize;
+	resources.skybox = 0;
+	resources.prefilteredSkybox = 0;
+	resources.ambientIrradianceUBO = ambientIrradianceUBO;
+	resources.probes = &reflectionProbes;
+	resources.emptyVAO = emptyVAO;
+	resources.textureCache = &textureCache;
+	resources.materialBuffer = materialBuffer;
+	resources.transmittanceLUT = 0;
+	resources.scatteringLUT = 0;
+	resources.resolution = &dynamicResolution;
+	resources.upscaleShader = upscaleShader;
+	resources.antiAliasing = &antiAliasing;
+	resources.fxaaShader = fxaaShader;
+	resources.smaaEdgesShader = smaaEdgesShader;
+	resources.smaaBlendShader = smaaBlendShader;
+	resources.taaShader = taaShader;
+
+	// From here on the GL context belongs to the render thread
+	RenderThread renderThread(window, [&](const FrameCommands& frame)
+	{
+		shaderWatcher.Update(shaderCompiler);
+		shaderCompiler.Poll();
+		loader.UploadPending(staging);
+		textureCache.Update();
+		resources.skybox = skyboxLoader.Update();
+		resources.prefilteredSkybox = environmentPrefilter.Update();
+		if(atmosphereTables.Update())
+		{
+			resources.transmittanceLUT = atmosphereTables.TransmittanceTexture();
+			resources.scatteringLUT = atmosphereTables.ScatteringTexture();
+		}
+		RenderFrame(resources, frame);
+	});
 
 	// Render loop
 	while(!glfwWindowShouldClose(window))
@@ -515,179 +2282,336 @@ int main()
 		// MVP uniforms
 		glm::mat4 viewMatrix = glm::lookAt(position, position + cameraDirection, cameraUp);
 		glm::mat4 projectionMatrix = glm::perspective(glm::radians(90.0f), windowWidth / windowHeight, 0.1f, 100.0f);
+		GLint renderWidth, renderHeight;
+		dynamicResolution.RenderSize(GLint(windowWidth), GLint(windowHeight), renderWidth, renderHeight);
 
+		// TAA moves the projection by a different subpixel offset every frame, once taa.fsh runs
+		glm::mat4 viewProjection = projectionMatrix * viewMatrix;
+		if(antiAliasingMode == AntiAliasing::TAA && antiAliasing.TaaApplied())
+		{
+			glm::vec2 jitter = AntiAliasing::Jitter(frameIndex);
+			projectionMatrix[2][0] += jitter.x * 2.0f / renderWidth;
+			projectionMatrix[2][1] += jitter.y * 2.0f / renderHeight;
+		}
+		frameIndex++;
+
+		// SUN
+		// rises and sets with the day/night light animation, the shadow map follows it
+		GLfloat sunElevation = glm::radians(50.0f) * glm::sin(currentTime * 0.8f);
+		glm::vec3 sunDirection(-glm::cos(sunElevation) * 0.7071f, glm::sin(sunElevation), -glm::cos(sunElevation) * 0.7071f);
+		directionalLightDirection = -sunDirection;
+		directionalLightPosition = sunDirection * 6.0f;
+		directionalLightViewMatrix = glm::lookAt(directionalLightPosition, directionalLightPosition + directionalLightDirection, glm::vec3(0, 1, 0));
+		// the sun fades out as it reaches the horizon, at night it would light things from below the floor
+		GLfloat sunlight = glm::clamp(sunDirection.y * 10.0f, 0.0f, 1.0f);
 
 		// SET OBJECT TRANSFORMS
-		glBindVertexArray(objectVAO);
-		// cube
-		glm::mat4 firstMatrix = glm::scale(iMatrix, glm::vec3(6.0f, 6.0f, 6.0f));
-		firstMatrix = glm::translate(firstMatrix, glm::vec3(-1.5f, 0.5f, 0.0f));
-		firstMatrix = glm::rotate(firstMatrix, glm::radians(23.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		glm::mat4 secondMatrix = glm::scale(iMatrix, glm::vec3(4.5f, 4.5f, 4.5f));
-		secondMatrix = glm::translate(secondMatrix, glm::vec3(1.5f, 0.5f, 1.5f));
-		secondMatrix = glm::rotate(secondMatrix, glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-		glm::mat4 thirdMatrix = glm::scale(iMatrix, glm::vec3(3.0f, 3.0f, 3.0f));
-		thirdMatrix = glm::translate(thirdMatrix, glm::vec3(2.5f, 2.0f, -2.0f));
-		thirdMatrix = glm::rotate(thirdMatrix, glm::radians(currentTime * 40.0f), glm::vec3(1.0f, 1.0f, 1.0f));
-		glm::mat4 fourthMatrix = glm::scale(iMatrix, glm::vec3(1.5f, 1.5f, 1.5f));
-		fourthMatrix = glm::translate(fourthMatrix, glm::vec3(-2.0f, 3.5f, 5.0f));
-		fourthMatrix = glm::rotate(fourthMatrix, glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		fourthMatrix = glm::rotate(fourthMatrix, glm::radians(-90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-		glm::mat4 fifthMatrix = glm::scale(iMatrix, glm::vec3(1.5f, 6.0f, 1.5f));
-		fifthMatrix = glm::translate(fifthMatrix, glm::vec3(-0.0f, 0.8f, -5.0f));
-		fifthMatrix = glm::rotate(fifthMatrix, glm::radians(23.0f), glm::vec3(1.0f, 1.0f, 0.0f));
-		fifthMatrix = glm::rotate(fifthMatrix, glm::radians(currentTime * 60.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-		// plane
-		glm::mat4 planeMatrix = glm::scale(iMatrix, glm::vec3(30.0f, 1.0f, 30.0f));
-		planeMatrix = glm::translate(planeMatrix, glm::vec3(0, -0.5f, 0));
-		// bedroom
-		glm::mat4 bedroomMatrix = glm::scale(iMatrix, glm::vec3(7.0f, 7.0f, 7.0f));
-		bedroomMatrix = glm::rotate(bedroomMatrix, glm::radians(-90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		// monkey
-		glm::mat4 monkeyMatrix = glm::scale(iMatrix, glm::vec3(3.0f, 3.0f, 3.0f));
-		// skybox
-		glm::mat4 skyboxMatrix = glm::scale(iMatrix, glm::vec3(50.0f, 50.0f, 50.0f));
-
-
-		// SHADOW PASS
-		glUseProgram(depthShader);
-		glViewport(0, 0, depthTextureWidth, depthTextureHeight);
-		glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
-		glClear(GL_DEPTH_BUFFER_BIT);
-
-		glUniformMatrix4fv(glGetUniformLocation(depthShader, "lightProjection"), 1, GL_FALSE, glm::value_ptr(directionalLightProjectionMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(depthShader, "lightView"), 1, GL_FALSE, glm::value_ptr(directionalLightViewMatrix));
+		// light animation runs as its own job while the transforms are built
+		JobCounter lightCounter;
+		jobs.Run([&]
+		{
+			directionalLightDiffuse.x = glm::sin(currentTime * 0.8f) + 1.0f;
+			directionalLightDiffuse.y = glm::sin(currentTime * 0.8f) + 1.0f;
+			directionalLightDiffuse.z = glm::sin(currentTime * 0.8f) + 1.0f;
+			directionalLightAmbient.x = glm::clamp(glm::sin(currentTime * 0.8f) + 1.05f, 0.2f, 0.8f);
+			directionalLightAmbient.y = glm::clamp(glm::sin(currentTime * 0.8f) + 1.0f, 0.2f, 0.8f);
+			directionalLightAmbient.z = glm::clamp(glm::sin(currentTime * 0.8f) + 1.1f, 0.2f, 0.8f);
+
+			skyboxColor.x = glm::sin(currentTime * 0.8f) + 1.1f;
+			skyboxColor.y = glm::sin(currentTime * 0.8f) + 1.0f;
+			skyboxColor.z = glm::sin(currentTime * 0.8f) + 1.25f;
+		}, &lightCounter);
+
+		// only the spinning objects change, so only their nodes are recomputed
+		for(int i = 0; i < OBJECT_COUNT; i++)
+		{
+			if(sceneObjects[i].firstSpeed != 0.0f || sceneObjects[i].secondSpeed != 0.0f)
+				sceneGraph.SetRotation(objectNodes[i], ObjectRotation(sceneObjects[i], currentTime));
+		}
 
+		// GATHER DRAWS
+		// newly uploaded meshes add their nodes, so the graph is updated after them
+		loader.CollectUploaded();
+		sceneGraph.Update();
+		candidates.clear();
 		if(toggle == 1)
 		{
-			bedroom.Draw(depthShader, bedroomMatrix);
+			bedroom.Record(candidates);
 		} else if(toggle == 2)
 		{
-			monkey.Draw(depthShader, monkeyMatrix);
+			monkey.Record(candidates);
 		} else
 		{
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeEbo);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(firstMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(secondMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(thirdMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(fourthMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(fifthMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, planeEbo);
-			glUniformMatrix4fv(glGetUniformLocation(depthShader, "model"), 1, GL_FALSE, glm::value_ptr(planeMatrix));
-			glDrawElements(GL_TRIANGLES, planeIndicesSize, GL_UNSIGNED_INT, 0);
+			for(int i = FIRST_CUBE; i < PLANE; i++)
+			{
+				const glm::mat4& matrix = sceneGraph.World(objectNodes[i]);
+				candidates.push_back({ { objectVAO, cubeEbo, cubeIndicesSize, matrix, cubeRoughness[i - FIRST_CUBE] }, cubeBounds.Transformed(matrix) });
+			}
+			const glm::mat4& planeMatrix = sceneGraph.World(objectNodes[PLANE]);
+			candidates.push_back({ { objectVAO, planeEbo, planeIndicesSize, planeMatrix, planeRoughness }, cubeBounds.Transformed(planeMatrix) });
 		}
 
-		// RENDER PASS
-		glUseProgram(mainShader);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glViewport(0, 0, windowWidth, windowHeight);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		glActiveTexture(GL_TEXTURE1);
-
-		glUniformMatrix4fv(glGetUniformLocation(mainShader, "view"), 1, GL_FALSE, glm::value_ptr(viewMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(mainShader, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-		glUniform3fv(glGetUniformLocation(mainShader, "viewPosition"), 1, glm::value_ptr(position));
-
-		directionalLightDiffuse.x = glm::sin(currentTime * 0.8f) + 1.0f;
-		directionalLightDiffuse.y = glm::sin(currentTime * 0.8f) + 1.0f;
-		directionalLightDiffuse.z = glm::sin(currentTime * 0.8f) + 1.0f;
-		directionalLightAmbient.x = glm::clamp(glm::sin(currentTime * 0.8f) + 1.05f, 0.2f, 0.8f);
-		directionalLightAmbient.y = glm::clamp(glm::sin(currentTime * 0.8f) + 1.0f, 0.2f, 0.8f);
-		directionalLightAmbient.z = glm::clamp(glm::sin(currentTime * 0.8f) + 1.1f, 0.2f, 0.8f);
-
-		// directional light uniforms
-		glUniform3fv(glGetUniformLocation(mainShader, "directionalLightDirection"), 1, glm::value_ptr(directionalLightDirection));
-		glUniform3fv(glGetUniformLocation(mainShader, "directionalLightAmbient"), 1, glm::value_ptr(directionalLightAmbient));
-		glUniform3fv(glGetUniformLocation(mainShader, "directionalLightDiffuse"), 1, glm::value_ptr(directionalLightDiffuse));
-		glUniform3fv(glGetUniformLocation(mainShader, "directionalLightSpecular"), 1, glm::value_ptr(directionalLightSpecular));
+		// CULLING AND DRAW KEYS
+		// the shadow pass is culled against the light's frustum, not the camera's
+		Frustum cameraFrustum(projectionMatrix * viewMatrix);
+		Frustum lightFrustum(directionalLightProjectionMatrix * directionalLightViewMatrix);
+		// meshes pick their level of detail from their distance to the camera, in both passes
+		// at the resolution the main pass renders at
+		GLfloat pixelsPerUnit = projectionMatrix[1][1] * renderHeight * 0.5f;
+		candidateVisibility.resize(candidates.size());
+		candidateKeys.resize(candidates.size());
+		jobs.ParallelFor(0, candidates.size(), 256, [&](size_t begin, size_t end)
+		{
+			for(size_t i = begin; i < end; i++)
+			{
+				DrawCandidate& candidate = candidates[i];
+				candidateKeys[i] = MakeDrawKey(candidate, position);
+				candidateVisibility[i] = (cameraFrustum.Intersects(candidate.bounds) ? VISIBLE_MAIN : 0)
+					| (lightFrustum.Intersects(candidate.bounds) ? VISIBLE_SHADOW : 0);
+				// cull.csh culls again and picks the LODs, here visibility only drives texture streaming
+				if(candidate.mesh && candidateVisibility[i] && !gpuDriven)
+				{
+					candidate.lod = candidate.mesh->SelectLod(candidate.item.model, candidate.bounds, position, pixelsPerUnit, LOD_PIXEL_ERROR);
+					candidate.mesh->UseLod(candidate.item, candidate.lod);
+					candidate.shadowLod = candidate.mesh->SelectLod(candidate.item.model, candidate.bounds, position, pixelsPerUnit, LOD_PIXEL_ERROR * SHADOW_LOD_BIAS);
+				}
+			}
+		});
 
-		glUniformMatrix4fv(glGetUniformLocation(mainShader, "lightProjection"), 1, GL_FALSE, glm::value_ptr(directionalLightProjectionMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(mainShader, "lightView"), 1, GL_FALSE, glm::value_ptr(directionalLightViewMatrix));
+		drawOrder.resize(candidates.size());
+		for(size_t i = 0; i < drawOrder.size(); i++)
+			drawOrder[i] = i;
+		sort(drawOrder.begin(), drawOrder.end(), [&](size_t a, size_t b) { return candidateKeys[a] < candidateKeys[b]; });
 
+		// TEXTURE STREAMING
+		// visible meshes ask for the mips that match their size on screen
+		textureCache.BeginFrame();
+		for(size_t i = 0; i < candidates.size(); i++)
+		{
+			if((candidateVisibility[i] & VISIBLE_MAIN) && candidates[i].mesh)
+				candidates[i].mesh->RequestTextures(textureCache, candidates[i].bounds, position, pixelsPerUnit);
+		}
 
-		glUniform1i(glGetUniformLocation(mainShader, "reflective"), 0);
-		if(reflectionToggle)
-			glUniform1i(glGetUniformLocation(mainShader, "reflective"), 1);
+		jobs.Wait(lightCounter);
 
-		if(toggle == 1)
+		// REFLECTION PROBES
+		// the cubes share a probe above the plane, the bedroom gets one in the middle of the room
+		// with the room as its parallax box, the monkey only reflects the skybox
+		int activeProbe = -1;
+		ReflectionProbe probe;
+		if(toggle == 0)
 		{
-			bedroom.Draw(mainShader, bedroomMatrix);
-		} else if(toggle == 2)
+			activeProbe = 0;
+			probe.position = glm::vec3(0.0f, 4.0f, 0.0f);
+		} else if(toggle == 1 && !candidates.empty())
 		{
-			monkey.Draw(mainShader, monkeyMatrix);
-		} else
+			activeProbe = 1;
+			for(const DrawCandidate& candidate : candidates)
+			{
+				probe.box.Extend(candidate.bounds.min);
+				probe.box.Extend(candidate.bounds.max);
+			}
+			probe.position = (probe.box.min + probe.box.max) * 0.5f;
+		}
+		if(activeProbe != -1 && reflectionToggle)
+			reflectionProbes.Schedule(activeProbe, probeLayers);
+		else
+			probeLayers.clear();
+
+		// RECORD FRAME
+		FrameCommands& frame = renderThread.BeginFrame();
+		frame.viewportWidth = windowWidth;
+		frame.viewportHeight = windowHeight;
+		frame.renderWidth = renderWidth;
+		frame.renderHeight = renderHeight;
+		frame.antiAliasing = antiAliasingMode;
+		frame.unjitteredViewProjection = viewProjection;
+		frame.previousViewProjection = previousViewProjection;
+		previousViewProjection = viewProjection;
+
+		frame.viewMatrix = viewMatrix;
+		frame.projectionMatrix = projectionMatrix;
+		frame.viewPosition = position;
+
+		frame.directionalLightDirection = directionalLightDirection;
+		frame.directionalLightDiffuse = directionalLightDiffuse * sunlight;
+		frame.directionalLightSpecular = directionalLightSpecular * sunlight;
+		frame.lightProjection = directionalLightProjectionMatrix;
+		frame.lightView = directionalLightViewMatrix;
+
+		// the day/night tint goes on the coefficients; until the skybox has been
+		// projected this is the old flat ambient term
+		SphericalHarmonics ambientIrradiance = environmentPrefilter.Ready()
+			? environmentPrefilter.Irradiance() * directionalLightAmbient
+			: environment::ConstantAmbient(glm::vec3(0.7f)) * directionalLightAmbient;
+		for(int i = 0; i < 9; i++)
+			frame.ambientIrradiance[i] = glm::vec4(ambientIrradiance.coefficients[i], 0.0f);
+
+		frame.reflective = reflectionToggle;
+
+		frame.skyboxColor = skyboxColor;
+		frame.skyboxMatrix = sceneGraph.World(objectNodes[SKYBOX]);
+
+		frame.reflectionProbe = activeProbe != -1 && reflectionProbes.Ready(activeProbe) ? activeProbe : -1;
+		frame.probePosition = probe.position;
+		frame.probeBoxMin = probe.box.min;
+		frame.probeBoxMax = probe.box.max;
+		frame.probeParallax = probe.box.Valid();
+		for(GLint layer : probeLayers)
 		{
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeEbo);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(firstMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(secondMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(thirdMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(fourthMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(fifthMatrix));
-			glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
-
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, planeEbo);
-			glUniformMatrix4fv(glGetUniformLocation(mainShader, "model"), 1, GL_FALSE, glm::value_ptr(planeMatrix));
-			glDrawElements(GL_TRIANGLES, planeIndicesSize, GL_UNSIGNED_INT, 0);
-		}
-
-		// SKYBOX PASS
-		glDepthFunc(GL_LEQUAL);
-		glUseProgram(skyboxShader);
-		glBindVertexArray(objectVAO);
-		glm::mat4 skyboxViewMatrix = glm::mat4(glm::mat3(viewMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(skyboxShader, "view"), 1, GL_FALSE, glm::value_ptr(skyboxViewMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(skyboxShader, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-		glUniform3fv(glGetUniformLocation(skyboxShader, "skyboxColor"), 1, glm::value_ptr(skyboxColor));
-		skyboxColor.x = glm::sin(currentTime * 0.8f) + 1.1f;
-		skyboxColor.y = glm::sin(currentTime * 0.8f) + 1.0f;
-		skyboxColor.z = glm::sin(currentTime * 0.8f) + 1.25f;
-
-		glActiveTexture(GL_TEXTURE0);
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeEbo);
-		glUniformMatrix4fv(glGetUniformLocation(skyboxShader, "model"), 1, GL_FALSE, glm::value_ptr(skyboxMatrix));
-		glDrawElements(GL_TRIANGLES, cubeIndicesSize, GL_UNSIGNED_INT, 0);
+			frame.probeFaces.emplace_back();
+			ProbeFaceCommands& face = frame.probeFaces.back();
+			face.layer = layer;
+			face.position = probe.position;
+			face.viewMatrix = ReflectionProbes::FaceView(probe.position, layer % 6);
+			face.projectionMatrix = ReflectionProbes::FaceProjection();
+
+			Frustum faceFrustum(face.projectionMatrix * face.viewMatrix);
+			for(size_t i : drawOrder)
+			{
+				if(faceFrustum.Intersects(candidates[i].bounds))
+					face.draws.push_back(candidates[i].item);
+			}
+		}
 
-		glDepthFunc(GL_LESS);
+		// the GPU only needs the objects, with their geometry and its LODs
+		frame.gpuCulling = gpuDriven;
+		if(gpuDriven)
+		{
+			for(const DrawCandidate& candidate : candidates)
+			{
+				const DrawItem& item = candidate.item;
+				GLint geometry = gpuCulling.FindGeometry(item.vao, item.ebo);
+				if(geometry == -1)
+				{
+					geometry = gpuCulling.AddGeometry(item.vao, item.ebo);
+					if(candidate.mesh)
+					{
+						for(const Mesh::Lod& lod : candidate.mesh->lods)
+							gpuCulling.AddLod(geometry, lod.firstIndex, lod.indexCount, lod.error);
+					} else
+						gpuCulling.AddLod(geometry, item.firstIndex, item.indexCount, 0.0f);
+				}
+
+				GpuCulling::Object object;
+				object.model = item.model;
+				object.boundsMin = glm::vec4(candidate.bounds.min, item.roughness);
+				object.boundsMax = glm::vec4(candidate.bounds.max, MaxScale(item.model));
+				object.material = glm::ivec4(item.diffuseMap, item.specularMap, item.normalMap, geometry);
+				frame.gpuObjects.push_back(object);
+			}
+			gpuCulling.Record(frame.gpuObjects, frame.gpuGeometries, frame.gpuBatches);
 
-		// CLEAR
-		glBindVertexArray(0);
+			for(int i = 0; i < 6; i++)
+			{
+				frame.gpuView.planes[GpuCulling::PASS_MAIN][i] = cameraFrustum.planes[i];
+				frame.gpuView.planes[GpuCulling::PASS_SHADOW][i] = lightFrustum.planes[i];
+			}
+			frame.gpuView.position = position;
+			frame.gpuView.pixelsPerUnit = pixelsPerUnit;
+			frame.gpuView.maxPixelError[GpuCulling::PASS_MAIN] = LOD_PIXEL_ERROR;
+			frame.gpuView.maxPixelError[GpuCulling::PASS_SHADOW] = LOD_PIXEL_ERROR * SHADOW_LOD_BIAS;
+		} else
+		{
+			for(size_t i : drawOrder)
+			{
+				if(candidateVisibility[i] & VISIBLE_SHADOW)
+				{
+					frame.shadowDraws.push_back(candidates[i].item);
+					if(candidates[i].mesh)
+						candidates[i].mesh->UseLod(frame.shadowDraws.back(), candidates[i].shadowLod);
+				}
+				if(candidateVisibility[i] & VISIBLE_MAIN)
+				{
+					frame.mainDraws.push_back(candidates[i].item);
+					// meshes only keep the meshlets that are in view and face the camera
+					if(candidates[i].mesh && !candidates[i].mesh->CullMeshlets(frame.mainDraws.back(), candidates[i].lod, cameraFrustum, position, frame.drawRanges))
+						frame.mainDraws.pop_back();
+				}
+			}
+		}
 
-		glfwSwapBuffers(window);
+		renderThread.Submit();
 
 		glfwPollEvents();
 	}
 
-	glDeleteProgram(mainShader);
+	// Wait for the last frames and take the GL context back for cleanup
+	renderThread.Stop();
+	staging.Destroy();
+	reflectionProbes.Destroy();
+	dynamicResolution.Destroy();
+	antiAliasing.Destroy();
+	atmosphereTables.Destroy();
+	textureCache.Destroy();
+	gpuCulling.Destroy();
+
+	shaderCompiler.Stop();
+	glDeleteProgram(fallbackShader);
+	glDeleteProgram(gpuFallbackShader);
 
 	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &ambientIrradianceUBO);
+	glDeleteBuffers(1, &materialBuffer);
 	glDeleteVertexArrays(1, &objectVAO);
-
+	glDeleteVertexArrays(1, &emptyVAO);
 	glfwTerminate();
 
 	return 0;
 }
 
-GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath)
+bool HasArgument(int argc, char** argv, const string& flag)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		if(argv[i] == flag)
+			return true;
+	}
+	return false;
+}
+
+string ArgumentValue(int argc, char** argv, const string& flag)
+{
+	for(int i = 1; i + 1 < argc; i++)
+	{
+		if(argv[i] == flag)
+			return argv[i + 1];
+	}
+	return "";
+}
+
+// Inserts defines right after the #version line, which has to stay first
+std::string InjectDefines(const std::string& shaderSource, const std::string& defines)
 {
-	GLuint vertexShader = CreateShaderFromFile(GL_VERTEX_SHADER, vertexShaderFilePath);
-	GLuint fragmentShader = CreateShaderFromFile(GL_FRAGMENT_SHADER, fragmentShaderFilePath);
+	size_t version = shaderSource.find("#version");
+	if(defines.empty() || version == std::string::npos)
+		return defines + shaderSource;
+
+	size_t lineEnd = shaderSource.find('\n', version);
+	if(lineEnd == std::string::npos)
+		return shaderSource + "\n" + defines;
+	return shaderSource.substr(0, lineEnd + 1) + defines + shaderSource.substr(lineEnd + 1);
+}
+
+GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath, const std::string& defines)
+{
+	std::string vertexShaderSource = InjectDefines(ReadShaderFile(vertexShaderFilePath), defines);
+	std::string fragmentShaderSource = InjectDefines(ReadShaderFile(fragmentShaderFilePath), defines);
+
+	// a binary from an earlier run skips compiling and linking entirely
+	uint64_t cacheKey = programCache.Key({ vertexShaderSource, fragmentShaderSource });
+	GLuint program = programCache.Load(cacheKey);
+	if(program)
+		return program;
 
-	GLuint program = glCreateProgram();
+	GLuint vertexShader = CreateShaderFromSource(GL_VERTEX_SHADER, vertexShaderSource);
+	GLuint fragmentShader = CreateShaderFromSource(GL_FRAGMENT_SHADER, fragmentShaderSource);
+
+	program = glCreateProgram();
 	glAttachShader(program, vertexShader);
 	glAttachShader(program, fragmentShader);
 
+	programCache.PrepareForStore(program);
 	glLinkProgram(program);
 
 	glDetachShader(program, vertexShader);
@@ -704,29 +2628,44 @@ GLuint CreateShaderProgram(const std::string& vertexShaderFilePath, const std::s
 		GLsizei infoLogLen = sizeof(infoLog);
 		glGetProgramInfoLog(program, infoLogLen, &infoLogLen, infoLog);
 		std::cerr << "program link error: " << infoLog << std::endl;
-	}
+	} else
+		programCache.Store(cacheKey, program);
 
 	return program;
 }
 
+ShaderCompiler::Handle RequestShaderProgram(ShaderCompiler& compiler, const std::string& vertexShaderFilePath, const std::string& fragmentShaderFilePath,
+	const std::string& defines, ShaderCompiler::Setup setup)
+{
+	std::string vertexShaderSource = InjectDefines(ReadShaderFile(vertexShaderFilePath), defines);
+	std::string fragmentShaderSource = InjectDefines(ReadShaderFile(fragmentShaderFilePath), defines);
+	ShaderCompiler::Handle handle = compiler.Request(vertexShaderSource, fragmentShaderSource, setup);
+	shaderWatcher.Watch(handle, vertexShaderFilePath, fragmentShaderFilePath, defines);
+	return handle;
+}
+
 GLuint CreateShaderFromFile(const GLuint& shaderType, const std::string& shaderFilePath)
 {
-	std::ifstream shaderFile(shaderFilePath);
-	if(shaderFile.fail())
-	{
-		std::cerr << "Unable to open shader file: " << shaderFilePath << std::endl;
+	std::string shaderSource = ReadShaderFile(shaderFilePath);
+	if(shaderSource.empty())
 		return 0;
-	}
 
-	std::string shaderSource;
-	std::string temp;
-	while(std::getline(shaderFile, temp))
+	return CreateShaderFromSource(shaderType, shaderSource);
+}
+
+std::string ReadShaderFile(const std::string& shaderFilePath)
+{
+	std::ifstream shaderFile(shaderFilePath, std::ios::binary);
+	if(shaderFile.fail())
 	{
-		shaderSource += temp + "\n";
+		std::cerr << "Unable to open shader file: " << shaderFilePath << std::endl;
+		return "";
 	}
-	shaderFile.close();
 
-	return CreateShaderFromSource(shaderType, shaderSource);
+	// in one go instead of line by line
+	std::ostringstream shaderSource;
+	shaderSource << shaderFile.rdbuf();
+	return shaderSource.str();
 }
 
 GLuint CreateShaderFromSource(const GLuint& shaderType, const std::string& shaderSource)
@@ -752,11 +2691,370 @@ GLuint CreateShaderFromSource(const GLuint& shaderType, const std::string& shade
 	return shader;
 }
 
+void RunJobBenchmark()
+{
+	// the per frame work of the cube scene, scaled up to a lot of objects
+	const size_t objectCount = 200000;
+	const int frames = 20;
+
+	vector<ObjectAnimation> objects(objectCount);
+	for(size_t i = 0; i < objectCount; i++)
+	{
+		objects[i] = { glm::vec3(1.0f + i % 7), glm::vec3(i % 100, i / 100 % 100, i / 10000), glm::vec3(0.0f, 1.0f, 0.0f), GLfloat(i % 360), 40.0f, glm::vec3(1.0f, 0.0f, 0.0f), 0.0f, 60.0f };
+	}
+	vector<DrawCandidate> candidates(objectCount);
+	vector<uint8_t> visible(objectCount);
+	vector<uint64_t> keys(objectCount);
+
+	AABB cubeBounds;
+	cubeBounds.Extend(glm::vec3(-0.5f, -0.5f, -0.5f));
+	cubeBounds.Extend(glm::vec3(0.5f, 0.5f, 0.5f));
+	glm::vec3 viewPosition(50.0f, 50.0f, -20.0f);
+	Frustum frustum(glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, 100.0f) * glm::lookAt(viewPosition, glm::vec3(50.0f, 0.0f, 10.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+	unsigned int maxThreads = max(1u, thread::hardware_concurrency());
+	double singleThreadTime = 0.0;
+	for(unsigned int threads = 1; threads <= maxThreads; threads++)
+	{
+		JobSystem jobs(threads - 1);
+
+		auto start = chrono::steady_clock::now();
+		for(int frame = 0; frame < frames; frame++)
+		{
+			jobs.ParallelFor(0, objectCount, 1024, [&](size_t begin, size_t end)
+			{
+				for(size_t i = begin; i < end; i++)
+				{
+					glm::mat4 matrix = BuildObjectMatrix(objects[i], frame / 60.0f);
+					candidates[i] = { { 1, 1, 36, matrix, 0.5f }, cubeBounds.Transformed(matrix) };
+					visible[i] = frustum.Intersects(candidates[i].bounds);
+					keys[i] = MakeDrawKey(candidates[i], viewPosition);
+				}
+			});
+		}
+		double frameTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / frames;
+
+		if(threads == 1)
+			singleThreadTime = frameTime;
+		cout << threads << " thread(s): " << frameTime << " ms per frame, speedup " << singleThreadTime / frameTime << "x" << endl;
+	}
+}
+
+int CookSkybox()
+{
+	JobSystem jobs;
+
+	// decode all faces at once
+	vector<vector<unsigned char>> faces(6);
+	int faceWidths[6] = {}, faceHeights[6] = {};
+	jobs.ParallelFor(0, 6, 1, [&](size_t begin, size_t end)
+	{
+		for(size_t i = begin; i < end; i++)
+		{
+			int channels;
+			unsigned char* data = stbi_load(skyboxFaces[i].c_str(), &faceWidths[i], &faceHeights[i], &channels, 3);
+			if(!data)
+				continue;
+			faces[i].assign(data, data + size_t(faceWidths[i]) * faceHeights[i] * 3);
+			stbi_image_free(data);
+		}
+	});
+	for(int i = 0; i < 6; i++)
+	{
+		if(faces[i].empty() || faceWidths[i] != faceWidths[0] || faceHeights[i] != faceHeights[0])
+		{
+			cerr << "ERROR cubemap face " << skyboxFaces[i] << " is missing or differs in size" << endl;
+			return 1;
+		}
+	}
+
+	CompressedCubemap cubemap;
+	cubemap.width = faceWidths[0];
+	cubemap.height = faceHeights[0];
+	cubemap.levels = 1;
+	while((max(cubemap.width, cubemap.height) >> cubemap.levels) > 0)
+		cubemap.levels++;
+	cubemap.data.resize(cubemap.FaceSize() * 6);
+
+	// every face builds its own mip chain and compresses it
+	jobs.ParallelFor(0, 6, 1, [&](size_t begin, size_t end)
+	{
+		for(size_t face = begin; face < end; face++)
+		{
+			vector<unsigned char> level = faces[face];
+			int width = cubemap.width, height = cubemap.height;
+			for(int i = 0; i < cubemap.levels; i++)
+			{
+				bc1::Encode(level.data(), width, height, &cubemap.data[cubemap.Offset(face, i)]);
+				level = DownsampleRGB(level, width, height);
+				width = max(1, width / 2);
+				height = max(1, height / 2);
+			}
+		}
+	});
+
+	if(!SaveCompressedCubemap(skyboxCookedPath, cubemap))
+	{
+		cerr << "ERROR writing " << skyboxCookedPath << endl;
+		return 1;
+	}
+	cout << "Wrote " << skyboxCookedPath << ": " << cubemap.width << "x" << cubemap.height << ", "
+		<< cubemap.levels << " mip levels, " << cubemap.data.size() / 1024 << " KB" << endl;
+	return 0;
+}
+
+// materialBuffer receives the draws' material texture locations when the shader reads them,
+// ranges holds what is left of draws that went through meshlet culling
+void DrawItems(GLuint shader, const std::vector<DrawItem>& draws, GLuint materialBuffer, const std::vector<DrawRange>* ranges = nullptr)
+{
+	GLint modelLocation = glGetUniformLocation(shader, "model");
+	GLint roughnessLocation = glGetUniformLocation(shader, "roughness");
+	GLint drawIndexLocation = glGetUniformLocation(shader, "drawIndex");
+
+	// one entry per draw, the textures themselves all stay bound as arrays
+	if(materialBuffer != 0 && drawIndexLocation != -1)
+	{
+		std::vector<glm::ivec4> materials(draws.size());
+		for(size_t i = 0; i < draws.size(); i++)
+			materials[i] = glm::ivec4(draws[i].diffuseMap, draws[i].specularMap, draws[i].normalMap, 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(glm::ivec4), materials.data(), GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, materialBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	std::vector<GLsizei> rangeCounts;
+	std::vector<const void*> rangeOffsets;
+	for(size_t i = 0; i < draws.size(); i++)
+	{
+		const DrawItem& draw = draws[i];
+		glBindVertexArray(draw.vao);
+		if(draw.ebo != 0)
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, draw.ebo);
+		glUniformMatrix4fv(modelLocation, 1, GL_FALSE, glm::value_ptr(draw.model));
+		if(roughnessLocation != -1)
+			glUniform1f(roughnessLocation, draw.roughness);
+		if(drawIndexLocation != -1)
+			glUniform1i(drawIndexLocation, GLint(i));
+		if(draw.firstRange >= 0 && ranges)
+		{
+			rangeCounts.clear();
+			rangeOffsets.clear();
+			for(GLsizei range = 0; range < draw.rangeCount; range++)
+			{
+				const DrawRange& drawRange = (*ranges)[draw.firstRange + range];
+				rangeCounts.push_back(drawRange.indexCount);
+				rangeOffsets.push_back((const void*)(uintptr_t(drawRange.firstIndex) * sizeof(GLuint)));
+			}
+			glMultiDrawElements(GL_TRIANGLES, rangeCounts.data(), GL_UNSIGNED_INT, rangeOffsets.data(), draw.rangeCount);
+		} else
+			glDrawElements(GL_TRIANGLES, draw.indexCount, GL_UNSIGNED_INT, (void*)(uintptr_t(draw.firstIndex) * sizeof(GLuint)));
+	}
+}
+
+// Main pass and skybox into the bound framebuffer, from the camera or from a reflection probe
+// gpuDriven draws GpuCulling's main pass instead of draws
+void DrawScene(const RenderResources& resources, const FrameCommands& frame, GLuint mainShader, const glm::mat4& viewMatrix,
+	const glm::mat4& projectionMatrix, const glm::vec3& viewPosition, const std::vector<DrawItem>& draws, GLint reflectionProbe,
+	bool gpuDriven = false)
+{
+	glUseProgram(mainShader);
+	glUniformMatrix4fv(glGetUniformLocation(mainShader, "view"), 1, GL_FALSE, glm::value_ptr(viewMatrix));
+	glUniformMatrix4fv(glGetUniformLocation(mainShader, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+	glUniform3fv(glGetUniformLocation(mainShader, "viewPosition"), 1, glm::value_ptr(viewPosition));
+	glUniform1i(glGetUniformLocation(mainShader, "reflectionProbe"), reflectionProbe);
+
+	if(gpuDriven)
+		resources.gpuCulling->Draw(GpuCulling::PASS_MAIN, frame.gpuBatches);
+	else
+		DrawItems(mainShader, draws, resources.materialBuffer, &frame.drawRanges);
+
+	// SKY PASS
+	// the skybox cube is seen from the inside
+	glDepthFunc(GL_LEQUAL);
+	glDisable(GL_CULL_FACE);
+	glm::mat4 skyboxViewMatrix = glm::mat4(glm::mat3(viewMatrix));
+	GLuint skyShader = resources.shaders->Program(resources.skyShader);
+	GLuint skyboxShader = resources.shaders->Program(resources.skyboxShader);
+	if(resources.scatteringLUT && skyShader)
+	{
+		glUseProgram(skyShader);
+		glm::mat4 inverseViewProjection = glm::inverse(projectionMatrix * skyboxViewMatrix);
+		glUniformMatrix4fv(glGetUniformLocation(skyShader, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+		glBindVertexArray(resources.emptyVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	} else if(skyboxShader)
+	{
+		glUseProgram(skyboxShader);
+		glUniformMatrix4fv(glGetUniformLocation(skyboxShader, "view"), 1, GL_FALSE, glm::value_ptr(skyboxViewMatrix));
+		glUniformMatrix4fv(glGetUniformLocation(skyboxShader, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+
+		DrawItems(skyboxShader, { { resources.objectVAO, resources.cubeEbo, resources.cubeIndicesSize, frame.skyboxMatrix, 0.0f } }, 0);
+	}
+	glEnable(GL_CULL_FACE);
+	glDepthFunc(GL_LESS);
+}
+
+// Uniforms of a main shader variant that stay the same for the whole frame
+void SetFrameUniforms(GLuint mainShader, const RenderResources& resources, const FrameCommands& frame)
+{
+	glUseProgram(mainShader);
+
+	// directional light uniforms
+	glUniform3fv(glGetUniformLocation(mainShader, "directionalLights[0].direction"), 1, glm::value_ptr(frame.directionalLightDirection));
+	glUniform3fv(glGetUniformLocation(mainShader, "directionalLights[0].diffuse"), 1, glm::value_ptr(frame.directionalLightDiffuse));
+	glUniform3fv(glGetUniformLocation(mainShader, "directionalLights[0].specular"), 1, glm::value_ptr(frame.directionalLightSpecular));
+
+	glUniformMatrix4fv(glGetUniformLocation(mainShader, "lightProjection"), 1, GL_FALSE, glm::value_ptr(frame.lightProjection));
+	glUniformMatrix4fv(glGetUniformLocation(mainShader, "lightView"), 1, GL_FALSE, glm::value_ptr(frame.lightView));
+
+	glUniform3fv(glGetUniformLocation(mainShader, "probePosition"), 1, glm::value_ptr(frame.probePosition));
+	glUniform3fv(glGetUniformLocation(mainShader, "probeBoxMin"), 1, glm::value_ptr(frame.probeBoxMin));
+	glUniform3fv(glGetUniformLocation(mainShader, "probeBoxMax"), 1, glm::value_ptr(frame.probeBoxMax));
+	glUniform1i(glGetUniformLocation(mainShader, "probeParallax"), frame.probeParallax ? 1 : 0);
+
+	glUniform1i(glGetUniformLocation(mainShader, "skyboxLoaded"), resources.skybox != 0);
+	glUniform1i(glGetUniformLocation(mainShader, "prefilteredLoaded"), resources.prefilteredSkybox != 0);
+}
+
+void RenderFrame(const RenderResources& resources, const FrameCommands& frame)
+{
+	// GPU CULLING
+	// both passes' draw commands, from the objects the main thread recorded
+	bool gpuDriven = frame.gpuCulling && resources.gpuCulling;
+	resources.resolution->BeginFrame(frame.viewportWidth, frame.viewportHeight, AntiAliasing::Samples(frame.antiAliasing));
+	if(gpuDriven)
+		resources.gpuCulling->Cull(frame.gpuObjects, frame.gpuGeometries, frame.gpuView);
+
+	// SHADOW PASS
+	// until the depth shader is ready the cleared map just means no shadows
+	glViewport(0, 0, resources.depthTextureWidth, resources.depthTextureHeight);
+	glBindFramebuffer(GL_FRAMEBUFFER, resources.shadowFBO);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	GLuint depthShader = resources.shaders->Program(gpuDriven ? resources.gpuDepthShader : resources.depthShader);
+	if(depthShader)
+	{
+		glUseProgram(depthShader);
+		glUniformMatrix4fv(glGetUniformLocation(depthShader, "lightProjection"), 1, GL_FALSE, glm::value_ptr(frame.lightProjection));
+		glUniformMatrix4fv(glGetUniformLocation(depthShader, "lightView"), 1, GL_FALSE, glm::value_ptr(frame.lightView));
+
+		if(gpuDriven)
+			resources.gpuCulling->Draw(GpuCulling::PASS_SHADOW, frame.gpuBatches);
+		else
+			DrawItems(depthShader, frame.shadowDraws, 0);
+	}
+
+	// FRAME UNIFORMS
+	// the camera gets filtered shadows, the small probe faces make do with hard ones.
+	// Probe faces are culled on the CPU and always drawn from uniforms.
+	ShaderFeatures features;
+	features.reflection = frame.reflective;
+	ShaderFeatures probeFeatures = features;
+	probeFeatures.shadowFilter = ShaderFeatures::SHADOW_HARD;
+	features.gpuDriven = gpuDriven;
+
+	GLuint mainShader = resources.mainShaders->Get(features);
+	if(!mainShader)
+		mainShader = gpuDriven ? resources.gpuFallbackShader : resources.fallbackShader;
+	SetFrameUniforms(mainShader, resources, frame);
+	GLuint probeShader = mainShader;
+	if(!frame.probeFaces.empty())
+	{
+		probeShader = resources.mainShaders->Get(probeFeatures);
+		if(!probeShader)
+			probeShader = resources.fallbackShader;
+		SetFrameUniforms(probeShader, resources, frame);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, resources.ambientIrradianceUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame.ambientIrradiance), frame.ambientIrradiance);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, resources.skybox);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, resources.prefilteredSkybox);
+	glActiveTexture(GL_TEXTURE0);
+	resources.textureCache->BindArrays(MATERIAL_TEXTURE_UNIT);
+
+	GLuint skyboxShader = resources.shaders->Program(resources.skyboxShader);
+	if(skyboxShader)
+	{
+		glUseProgram(skyboxShader);
+		glUniform3fv(glGetUniformLocation(skyboxShader, "skyboxColor"), 1, glm::value_ptr(frame.skyboxColor));
+		glUniform1i(glGetUniformLocation(skyboxShader, "skyboxLoaded"), resources.skybox != 0);
+	}
+
+	GLuint skyShader = resources.shaders->Program(resources.skyShader);
+	if(skyShader)
+	{
+		glUseProgram(skyShader);
+		glm::vec3 sunDirection = -glm::normalize(frame.directionalLightDirection);
+		glUniform3fv(glGetUniformLocation(skyShader, "sunDirection"), 1, glm::value_ptr(sunDirection));
+	}
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, resources.transmittanceLUT);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_3D, resources.scatteringLUT);
+	glActiveTexture(GL_TEXTURE0);
+
+	// REFLECTION PROBE PASS
+	// probes do not sample themselves, their reflections fall back to the skybox
+	if(!frame.probeFaces.empty())
+	{
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+		glActiveTexture(GL_TEXTURE0);
+
+		resources.probes->BeginUpdate();
+		for(const ProbeFaceCommands& face : frame.probeFaces)
+		{
+			resources.probes->BeginFace(face.layer);
+			DrawScene(resources, frame, probeShader, face.viewMatrix, face.projectionMatrix, face.position, face.draws, -1);
+		}
+		resources.probes->EndUpdate();
+	}
+
+	// RENDER PASS
+	// into the offscreen target, at the frame's dynamic resolution
+	resources.resolution->BindTarget(frame.renderWidth, frame.renderHeight);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, resources.probes->Texture());
+	glActiveTexture(GL_TEXTURE0);
+
+	DrawScene(resources, frame, mainShader, frame.viewMatrix, frame.projectionMatrix, frame.viewPosition, frame.mainDraws, frame.reflectionProbe, gpuDriven);
+
+	// ANTI-ALIASING
+	// MSAA is resolved, the post filters run at the render resolution before the upscale
+	DynamicResolution& resolution = *resources.resolution;
+	resolution.Resolve();
+	AntiAliasing::Programs postPrograms;
+	postPrograms.fxaa = resources.shaders->Program(resources.fxaaShader);
+	postPrograms.smaaEdges = resources.shaders->Program(resources.smaaEdgesShader);
+	postPrograms.smaaBlend = resources.shaders->Program(resources.smaaBlendShader);
+	postPrograms.taa = resources.shaders->Program(resources.taaShader);
+	GLuint image = resources.antiAliasing->Apply(frame.antiAliasing, postPrograms, resolution.ColorTexture(), resolution.DepthTexture(),
+		resolution.RenderWidth(), resolution.RenderHeight(), resolution.Width(), resolution.Height(),
+		frame.unjitteredViewProjection, frame.previousViewProjection, resources.emptyVAO);
+
+	// UPSCALE
+	resolution.Present(image, resources.shaders->Program(resources.upscaleShader), resources.emptyVAO);
+
+	// CLEAR
+	glBindVertexArray(0);
+}
+
 void FramebufferSizeChangedCallback(GLFWwindow* window, int width, int height)
 {
 	// Whenever the size of the framebuffer changed (due to window resizing, etc.),
-	// update the dimensions of the region to the new size
-	glViewport(0, 0, width, height);
+	// remember the new size. The render thread picks it up with the next recorded frame.
+	if(width == 0 || height == 0)
+		return; // minimized
+	windowWidth = width;
+	windowHeight = height;
 }
 
 void getInput()
@@ -767,6 +3065,15 @@ void getInput()
 		position.y -= 0.1f;
 }
 
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if(key == GLFW_KEY_A && action == GLFW_PRESS)
+	{
+		antiAliasingMode = (antiAliasingMode + 1) % AntiAliasing::MODE_COUNT;
+		std::cout << "anti-aliasing: " << AntiAliasing::Name(antiAliasingMode) << std::endl;
+	}
+}
+
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 {
 	if(button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)